@@ -120,63 +120,130 @@ bool is_directory(const std::string &path)
     return false;
 }
 
-std::string urlDecode(const std::string &str)
+// Values of the hex digits, -1 for every other byte
+struct HexTable
 {
-    std::ostringstream decoded;
-    for (size_t i = 0; i < str.length(); ++i)
+    signed char value[256];
+
+    HexTable()
     {
-        if (str[i] == '%' && i + 2 < str.length() &&
-            std::isxdigit(str[i + 1]) && std::isxdigit(str[i + 2]))
+        for (int c = 0; c < 256; ++c)
+            value[c] = -1;
+        for (int c = 0; c < 10; ++c)
+            value['0' + c] = static_cast<signed char>(c);
+        for (int c = 0; c < 6; ++c)
         {
-            std::string hex = str.substr(i + 1, 2);
-            int value;
-            std::istringstream iss(hex);
-            iss >> std::hex >> value;
-            char ch = static_cast<char>(value);
-
-            decoded << ch;
-            i += 2;
+            value['a' + c] = static_cast<signed char>(10 + c);
+            value['A' + c] = static_cast<signed char>(10 + c);
         }
-        else if (str[i] == '+')
-            decoded << ' ';
-        else
-            decoded << str[i];
     }
-    return decoded.str();
+};
+
+static const HexTable hex_table;
+
+// path[segment, end) is the last segment of a canonical path, segment
+// being just past its '/'. Drops it when it is ".", and the segment before
+// it too when it is "..", never going above the leading '/'. Returns the
+// new end of the path.
+static size_t resolve_dot_segment(const char *path, size_t end, size_t segment)
+{
+    size_t length = end - segment;
+    if (length == 1 && path[segment] == '.')
+        return segment;
+    if (length != 2 || path[segment] != '.' || path[segment + 1] != '.')
+        return end;
+    if (segment == 1)
+        return 1;
+    size_t previous = segment - 1;
+    while (path[previous - 1] != '/')
+        --previous;
+    return previous;
 }
 
-std::string remove_slash(std::string path)
+// Split a request target at its '?' and turn the part before into a
+// canonical path in one pass: percent-escapes and '+' decoded, runs of '/'
+// collapsed, "." and ".." segments resolved, a leading '/' added. It works
+// in place, since each byte written consumes one byte read or more, and
+// copies runs without '%', '+' or '/' 16 or 32 bytes at a time. The query
+// is kept as sent.
+void canonicalize_target(const StrView &target, std::string &path, std::string &query)
 {
-    size_t pos;
-    // Remove consecutive slashes
-    while ((pos = path.find("//")) != std::string::npos)
-    {
-        path.replace(pos, 2, "/");
-    }
+    const char *question = static_cast<const char *>(std::memchr(target.data, '?', target.size));
+    size_t length = question ? question - target.data : target.size;
+    if (question)
+        query.assign(question + 1, target.size - length - 1);
+    else
+        query.clear();
 
-    if (path.empty())
+    path.assign(1, '/');
+    path.append(target.data, length);
+    char *data = &path[0];
+    size_t size = path.size();
+    size_t in = 1;
+    size_t out = 1;
+    size_t segment = 1;
+    while (in < size)
     {
-        return "/";
-    }
+        size_t run = scan_path_special(data + in, size - in);
+        if (run > 0)
+        {
+            if (out != in)
+                std::memmove(data + out, data + in, run);
+            in += run;
+            out += run;
+            if (in == size)
+                break;
+        }
 
-    // Ensure path starts with /
-    if (path[0] != '/')
-    {
-        return "/" + path;
+        char c = data[in++];
+        if (c == '%' && in + 1 < size)
+        {
+            int high = hex_table.value[static_cast<unsigned char>(data[in])];
+            int low = hex_table.value[static_cast<unsigned char>(data[in + 1])];
+            if (high >= 0 && low >= 0)
+            {
+                c = static_cast<char>(high * 16 + low);
+                in += 2;
+            }
+        }
+        else if (c == '+')
+            c = ' ';
+
+        // A decoded "%2F" separates segments like '/' itself, so an
+        // encoded ".." cannot get past the resolution either
+        if (c == '/')
+        {
+            out = resolve_dot_segment(data, out, segment);
+            if (data[out - 1] != '/')
+                data[out++] = '/';
+            segment = out;
+        }
+        else
+            data[out++] = c;
     }
+    path.resize(resolve_dot_segment(data, out, segment));
+}
 
-    return path;
+// Method names are case-sensitive, in requests and in the method directive
+HttpMethod method_from_name(const char *name, size_t length)
+{
+    if (length == 3 && std::memcmp(name, "GET", 3) == 0)
+        return METHOD_GET;
+    if (length == 4 && std::memcmp(name, "POST", 4) == 0)
+        return METHOD_POST;
+    if (length == 6 && std::memcmp(name, "DELETE", 6) == 0)
+        return METHOD_DELETE;
+    return METHOD_OTHER;
 }
 
-void parsing_method(Request &rec, const std::string &line)
+void parsing_method(Request &rec, const StrView &method, const StrView &target, const StrView &version)
 {
-    std::istringstream input(line);
+    rec.mthod.assign(method.data, method.size);
+    rec.method = method_from_name(method.data, method.size);
+    rec.outcome = OUTCOME_NONE;
+    rec.version.assign(version.data, version.size);
     std::string filename;
-    input >> rec.mthod >> filename >> rec.version;
-
-    // URL decode and normalize the filename
-    filename = urlDecode(filename);
-    filename = remove_slash(filename);
+    canonicalize_target(target, filename, rec.query);
 
     // Check if the redirection is needed
     rec.found_redirection = false;
@@ -226,8 +293,9 @@ void parsing_method(Request &rec, const std::string &line)
         }
     }
 
-    rec.path = rec.root + filename;
-    rec.path = remove_first_slash(rec.path);
+    rec.path = rec.root;
+    rec.path += filename;
+    rec.path.erase(0, std::min(rec.path.find_first_not_of('/'), rec.path.size()));
     if (rec.path.empty() || rec.path == "/")
         rec.path = "../home";
 
@@ -235,7 +303,7 @@ void parsing_method(Request &rec, const std::string &line)
 }
 
 // Enhanced GET request handling with better concurrent support
-void parsing_Get(std::map<std::string, std::string> &headers,
+void parsing_Get(const std::string &range,
                  std::string path, int fd, std::string content_type,
                  std::string uri, ChunkedClientInfo &client)
 {
@@ -248,33 +316,34 @@ void parsing_Get(std::map<std::string, std::string> &headers,
 
     // Send file with appropriate content type and Range support
     std::string header = "HTTP/1.1 200 OK\r\nContent-Type: " + content_type + "\r\n";
-    response_plus(path, fd, header, headers);
+    response_plus(path, fd, header, range);
 }
 
 // Enhanced error response function
 void sendErrorResponse(int fd, int error_code, const std::string &error_message, std::string path_file)
 {
-    std::ostringstream response;
-    response << "HTTP/1.1 " << error_code << " " << error_message << "\r\n";
-    response << "Content-Type: text/html\r\n";
-    response << "Connection: close\r\n\r\n";
-    std::string resp_str = response.str();
-    send(fd, resp_str.c_str(), resp_str.length(), MSG_NOSIGNAL);
     // read file
     if (path_file.empty())
     {
         path_file = "error_page/404.html";
     }
+    std::string body;
     std::ifstream file(path_file.c_str(), std::ios::binary);
     char buffer[BUFFER_SIZE];
     if (file.is_open())
     {
         while (file.read(buffer, BUFFER_SIZE) || file.gcount() > 0)
-        {
-            std::streamsize bytesRead = file.gcount();
-            // Send the buffer to the client
-            send(fd, &buffer[0], bytesRead, MSG_NOSIGNAL);
-        }
+            body.append(buffer, file.gcount());
         file.close();
     }
+
+    // The length delimits the page, so the connection can carry another request
+    std::ostringstream response;
+    response << "HTTP/1.1 " << error_code << " " << error_message << "\r\n";
+    response << "Content-Type: text/html\r\n";
+    response << "Content-Length: " << body.size() << "\r\n";
+    response << connection_header(fd) << "\r\n";
+    std::string resp_str = response.str();
+    queue_send(fd, resp_str.c_str(), resp_str.length());
+    queue_send(fd, body.c_str(), body.length());
 }
\ No newline at end of file
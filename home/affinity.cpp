@@ -0,0 +1,100 @@
+#include "server.hpp"
+#include <sched.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+
+// Worker placement. A pinned worker runs on one CPU and allocates from
+// that CPU's NUMA node: its connection slabs, output buffers and ring are
+// first touched by the worker itself, after it was pinned. The memory
+// policy calls go through syscall(), so the build does not need libnuma.
+
+// CPUs the process was started on, before any thread was pinned
+static cpu_set_t process_cpus;
+static pthread_once_t process_cpus_once = PTHREAD_ONCE_INIT;
+
+// Runs on a thread that is not pinned yet: the first caller is the
+// configuration parser or a worker about to pin itself
+static void save_process_cpus()
+{
+    CPU_ZERO(&process_cpus);
+    if (sched_getaffinity(0, sizeof(process_cpus), &process_cpus) == -1)
+    {
+        perror("sched_getaffinity");
+        for (int cpu = 0; cpu < sysconf(_SC_NPROCESSORS_ONLN) && cpu < CPU_SETSIZE; ++cpu)
+            CPU_SET(cpu, &process_cpus);
+    }
+}
+
+// CPUs the process may run on, in order; "worker_cpu_affinity auto"
+// hands them out one per worker
+std::vector<int> allowed_cpus()
+{
+    pthread_once(&process_cpus_once, save_process_cpus);
+    std::vector<int> cpus;
+    for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+    {
+        if (CPU_ISSET(cpu, &process_cpus))
+            cpus.push_back(cpu);
+    }
+    return cpus;
+}
+
+// NUMA node holding the page at addr, -1 when the kernel cannot tell
+static int memory_node(const void *addr)
+{
+    int node = -1;
+    if (syscall(SYS_get_mempolicy, &node, NULL, 0, addr, MPOL_F_NODE | MPOL_F_ADDR) == -1)
+        return -1;
+    return node;
+}
+
+// Called by the worker's own thread (or process) before it allocates
+// anything per connection: pin it to worker.cpu, prefer its local node
+// for new memory, carve the first connection slab there, and report
+// where the worker and the slab ended up
+void place_worker(Worker &worker)
+{
+    pthread_once(&process_cpus_once, save_process_cpus);
+    if (worker.cpu >= 0)
+    {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(worker.cpu, &set);
+        int err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+        if (err != 0)
+        {
+            std::cerr << "Worker " << worker.id << ": cannot pin to CPU " << worker.cpu << ": "
+                      << strerror(err) << std::endl;
+            worker.cpu = -1;
+        }
+        else
+        {
+            // Overrides an inherited interleave policy; fails harmlessly
+            // (ENOSYS) on kernels built without NUMA
+            syscall(SYS_set_mempolicy, MPOL_LOCAL, NULL, 0);
+        }
+    }
+
+    worker.clients.reserve(CONNECTION_SLAB_SIZE);
+    unsigned cpu = 0;
+    unsigned node = 0;
+    syscall(SYS_getcpu, &cpu, &node, NULL);
+    int slab_node = memory_node(worker.clients.connections().slab(0));
+
+    std::cout << "Worker " << worker.id << (worker.cpu >= 0 ? " pinned to CPU " : " running on CPU ") << cpu
+              << " (node " << node << "), connection slabs on node ";
+    if (slab_node >= 0)
+        std::cout << slab_node;
+    else
+        std::cout << "unknown";
+    std::cout << std::endl;
+}
+
+// In a forked CGI child: run on any CPU of the process again, so scripts
+// do not compete with the worker loop for its core
+void release_cpu_affinity()
+{
+    pthread_once(&process_cpus_once, save_process_cpus);
+    sched_setaffinity(0, sizeof(process_cpus), &process_cpus);
+    syscall(SYS_set_mempolicy, MPOL_DEFAULT, NULL, 0);
+}
@@ -0,0 +1,97 @@
+#include "scan_kernels.hpp"
+#include "../request_parser.cpp"
+#include <cstdio>
+
+// Time RequestParser::parse() on request heads of growing size with each
+// scan kernel this CPU can run. Long cookies and tokens are where the
+// vector kernels pay off; a small head mostly measures the state machine.
+
+static double now()
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+// Base64-looking filler, the alphabet of session ids and JWTs
+static std::string filler(size_t size)
+{
+    static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_=";
+    std::string text;
+    for (size_t i = 0; i < size; ++i)
+        text += alphabet[(i * 7 + i / 3) % (sizeof(alphabet) - 1)];
+    return text;
+}
+
+// Best of five runs, in ns per parsed head
+static double time_parse(const std::string &head)
+{
+    int iterations = 2000000 / (head.size() / 100 + 1);
+    double best = 1e9;
+    for (int run = 0; run < 5; ++run)
+    {
+        size_t parsed = 0;
+        double start = now();
+        for (int i = 0; i < iterations; ++i)
+        {
+            RequestParser parser;
+            if (parser.parse(head.data(), head.size()) != RequestParser::PARSE_DONE)
+                return -1;
+            parsed += parser.head_size();
+        }
+        double ns = (now() - start) * 1e9 / iterations;
+        if (ns < best && parsed > 0)
+            best = ns;
+    }
+    return best;
+}
+
+int main()
+{
+    std::string browser = "GET /static/js/app.3f2a9c.js?v=20240101 HTTP/1.1\r\n"
+                          "Host: localhost:8080\r\n"
+                          "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) "
+                          "Chrome/120.0.0.0 Safari/537.36\r\n"
+                          "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,image/avif,image/webp,*/*;q=0.8\r\n"
+                          "Accept-Language: en-US,en;q=0.9\r\n"
+                          "Accept-Encoding: gzip, deflate, br\r\n"
+                          "Connection: keep-alive\r\n"
+                          "Referer: http://localhost:8080/dashboard/overview\r\n"
+                          "Sec-Fetch-Dest: script\r\n"
+                          "Sec-Fetch-Mode: no-cors\r\n"
+                          "Sec-Fetch-Site: same-origin\r\n";
+    const char *names[3] = {"browser, small cookie", "2 kB cookies + JWT auth", "8 kB cookies"};
+    std::string heads[3];
+    heads[0] = browser + "Cookie: sid=" + filler(40) + "\r\n\r\n";
+    heads[1] = browser + "Cookie: _ga=GA1.1." + filler(60) + "; session=" + filler(900) + "; prefs=" + filler(1000) +
+               "\r\nAuthorization: Bearer " + filler(800) + "\r\n\r\n";
+    heads[2] = browser + "Cookie: a=" + filler(4000) + "; b=" + filler(4000) + "\r\n\r\n";
+
+    ScanKernels kernels[3];
+    size_t count = available_kernels(kernels);
+    ScanKernels picked = scan_kernels;
+    for (int h = 0; h < 3; ++h)
+    {
+        printf("%-24s %5lu bytes:", names[h], static_cast<unsigned long>(heads[h].size()));
+        double scalar = 0;
+        for (size_t k = 0; k < count; ++k)
+        {
+            scan_kernels = kernels[k];
+            double ns = time_parse(heads[h]);
+            if (ns < 0)
+            {
+                printf("\n%s: the head did not parse\n", kernels[k].name);
+                return 1;
+            }
+            if (k == 0)
+                scalar = ns;
+            printf("  %s %6.0f ns (%.2f GB/s)", kernels[k].name, ns, heads[h].size() / ns);
+            if (k > 0)
+                printf(" x%.1f", scalar / ns);
+        }
+        printf("\n");
+    }
+    scan_kernels = picked;
+    printf("The server picks %s\n", scan_kernel_name());
+    return 0;
+}
@@ -0,0 +1,60 @@
+#include "scan_kernels.hpp"
+
+// Random buffers, dense or sparse in the bytes the kernels look for, at
+// random alignments and lengths: every vector kernel has to agree with its
+// scalar loop, tails included.
+
+static char random_byte(int round)
+{
+    int r = rand() % (round % 2 ? 100 : 3000);
+    if (r < 2)
+        return '\r';
+    if (r < 4)
+        return '\n';
+    if (r < 6)
+        return ' ';
+    if (r < 7)
+        return 0x7f;
+    if (r < 8)
+        return static_cast<char>(rand() % 32);
+    if (r < 10)
+        return static_cast<char>(0x80 + rand() % 128);
+    if (r < 11)
+        return "%+/"[rand() % 3];
+    return static_cast<char>('!' + rand() % 94);
+}
+
+int main()
+{
+    ScanKernels kernels[3];
+    size_t count = available_kernels(kernels);
+    char buffer[300];
+    long checks = 0;
+
+    srand(7);
+    for (int round = 0; round < 200000; ++round)
+    {
+        for (size_t i = 0; i < sizeof(buffer); ++i)
+            buffer[i] = random_byte(round);
+        size_t offset = rand() % 64;
+        size_t size = rand() % (sizeof(buffer) - offset);
+        const char *data = buffer + offset;
+
+        for (size_t k = 1; k < count; ++k)
+        {
+            if (kernels[k].line_end(data, size) != kernels[0].line_end(data, size) ||
+                kernels[k].target_end(data, size) != kernels[0].target_end(data, size) ||
+                kernels[k].path_special(data, size) != kernels[0].path_special(data, size))
+            {
+                std::cerr << kernels[k].name << " disagrees with the scalar scan in round " << round << std::endl;
+                return 1;
+            }
+            checks++;
+        }
+    }
+    std::cout << "scan kernels agree:";
+    for (size_t k = 0; k < count; ++k)
+        std::cout << " " << kernels[k].name;
+    std::cout << " (" << checks << " buffers compared)" << std::endl;
+    return 0;
+}
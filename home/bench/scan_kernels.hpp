@@ -0,0 +1,23 @@
+// The scan kernels are static to header_scan.cpp, so the benchmark and the
+// fuzz check build it into themselves and switch scan_kernels between the
+// ones this CPU can run.
+#include "../header_scan.cpp"
+
+static size_t available_kernels(ScanKernels *kernels)
+{
+    size_t count = 0;
+    ScanKernels scalar = {"scalar", line_end_scalar, target_end_scalar, path_special_scalar};
+    kernels[count++] = scalar;
+#ifdef SCAN_SSE2
+    ScanKernels sse2 = {"SSE2", line_end_sse2, target_end_sse2, path_special_sse2};
+    kernels[count++] = sse2;
+#endif
+#ifdef SCAN_AVX2
+    if (__builtin_cpu_supports("avx2"))
+    {
+        ScanKernels avx2 = {"AVX2", line_end_avx2, target_end_avx2, path_special_avx2};
+        kernels[count++] = avx2;
+    }
+#endif
+    return count;
+}
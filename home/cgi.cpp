@@ -10,9 +10,7 @@
 #include <fcntl.h>
 #include <poll.h>
 #include <functional>
-
-// CGI timeout in seconds
-#define CGI_TIMEOUT 10
+#include <algorithm>
 
 bool is_cgi_request(const std::string &path)
 {
@@ -38,62 +36,15 @@ std::string int_to_string(int n)
     return ss.str();
 }
 
-// Helper function to check if process is still running
-bool is_process_running(pid_t pid)
-{
-    int status;
-    pid_t result = waitpid(pid, &status, WNOHANG);
-    return (result == 0); // 0 means process is still running
-}
-
-// Helper function to get elapsed time in seconds using time_t
-long get_elapsed_seconds(const time_t &start_time)
-{
-    time_t current_time = time(NULL);
-    return (long)(current_time - start_time);
-}
-
-// Simple read with timeout check
-int read_with_timeout_select(int fd, char *buffer, size_t buffer_size, int timeout_sec,
-                             const time_t &start_time, std::string &accumulated_output)
-{
-    long elapsed = get_elapsed_seconds(start_time);
-    if (elapsed >= timeout_sec)
-    {
-        return -1; // Timeout
-    }
-
-    // Try a non-blocking read
-    ssize_t bytes_read = read(fd, buffer, buffer_size - 1);
-
-    if (bytes_read > 0)
-    {
-        buffer[bytes_read] = '\0';
-        accumulated_output += std::string(buffer, bytes_read);
-        return bytes_read;
-    }
-    else if (bytes_read == 0)
-    {
-        return 0; // EOF
-    }
-    else if (bytes_read == -1)
-    {
-        // For non-blocking I/O, assume it's just no data available
-        return -2; // Try again
-    }
-
-    return -1; // Should not reach here
-}
-
-// Alternative implementation using poll
-
-void handle_cgi_request(ChunkedClientInfo &client, int new_socket, std::map<std::string, std::string> &headers)
+void handle_cgi_request(ChunkedClientInfo &client, int new_socket)
 {
     // Set server_config after we know it's valid
     static int number = 0;
     number++;
     std::cout << "======= ============== >> " << number << std::endl ;
     client.request_obj.server_config = &client.request_obj.server;
+    // CGI output has no length the server can vouch for: close after it
+    client.keep_alive = false;
 
     std::string script_path = client.request_obj.path;
 
@@ -109,6 +60,7 @@ void handle_cgi_request(ChunkedClientInfo &client, int new_socket, std::map<std:
     env_strings.push_back("GATEWAY_INTERFACE=CGI/1.1");
     env_strings.push_back("REQUEST_URI=" + client.request_obj.uri);
     env_strings.push_back("PATH_INFO=" + client.request_obj.uri);
+    env_strings.push_back("QUERY_STRING=" + client.request_obj.query);
     env_strings.push_back("SCRIPT_NAME=" + script_path);
 
     // Add server information
@@ -118,11 +70,12 @@ void handle_cgi_request(ChunkedClientInfo &client, int new_socket, std::map<std:
         env_strings.push_back("SERVER_PORT=" + int_to_string(client.request_obj.server_config->port));
     }
 
-    if (client.request_obj.mthod == "POST")
+    if (client.request_obj.method == METHOD_POST)
     {
         env_strings.push_back("CONTENT_LENGTH=" + int_to_string(client.request_obj.info_body.length()));
-        if (headers.find("Content-Type") != headers.end())
-            env_strings.push_back("CONTENT_TYPE=" + headers["Content-Type"]);
+        StrView content_type = request_header(client, HEADER_CONTENT_TYPE);
+        if (!content_type.empty())
+            env_strings.push_back("CONTENT_TYPE=" + content_type.str());
         else
             env_strings.push_back("CONTENT_TYPE=application/x-www-form-urlencoded");
     }
@@ -133,13 +86,15 @@ void handle_cgi_request(ChunkedClientInfo &client, int new_socket, std::map<std:
         envp.push_back(const_cast<char *>(env_strings[i].c_str()));
     envp.push_back(NULL);
 
-    // Create pipes
+    // Create pipes, close-on-exec: a script forked by another worker thread
+    // meanwhile must not keep this one's output open
     int pipefd[2], stdin_pipe[2];
-    if (pipe(pipefd) == -1 || pipe(stdin_pipe) == -1)
+    if (pipe2(pipefd, O_CLOEXEC) == -1 || pipe2(stdin_pipe, O_CLOEXEC) == -1)
     {
         perror("pipe failed");
-        std::string error_response = "HTTP/1.1 500 Internal Server Error\r\nContent-Type: text/html\r\n\r\n<h1>500 Internal Server Error</h1>";
-        send(new_socket, error_response.c_str(), error_response.length(), 0);
+        std::string error_response = "HTTP/1.1 500 Internal Server Error\r\nContent-Type: text/html\r\nConnection: close\r\n\r\n<h1>500 Internal Server Error</h1>";
+        queue_send(new_socket, error_response.c_str(), error_response.length());
+        finish_request(client);
         return;
     }
 
@@ -148,6 +103,9 @@ void handle_cgi_request(ChunkedClientInfo &client, int new_socket, std::map<std:
     if (pid == 0)
     {
         // Child process
+        release_cpu_affinity();
+        // An ignored SIGPIPE survives execve(); the script gets the default
+        signal(SIGPIPE, SIG_DFL);
         close(pipefd[0]);
         close(stdin_pipe[1]);
 
@@ -185,199 +143,260 @@ void handle_cgi_request(ChunkedClientInfo &client, int new_socket, std::map<std:
         close(pipefd[1]);
         close(stdin_pipe[0]);
 
-        struct epoll_event ev;
-        ev.events = EPOLLIN;
-        // Handle POST data
-        if (client.request_obj.mthod == "POST")
+        // The body is fed to the script as its stdin takes it, by
+        // on_cgi_stdin_event(); closing the pipe is its EOF
+        fcntl(stdin_pipe[1], F_SETFL, O_NONBLOCK);
+        client.cgi_stdin.fd = stdin_pipe[1];
+        client.cgi_stdin.sent = 0;
+        client.cgi_stdin.pending.clear();
+        if (client.request_obj.method == METHOD_POST)
         {
-            // Set stdin pipe to non-blocking mode]
-            int flags = fcntl(stdin_pipe[1], F_GETFL, 0);
-            fcntl(stdin_pipe[1], F_SETFL, flags | O_NONBLOCK);
-            epoll_ctl(client.request_obj.epfd, EPOLL_CTL_ADD, flags, &ev);
-
-            // Write CGI headers if available
-            if (!client.cgi_headrs.empty())
-            {
-                ssize_t written = write(stdin_pipe[1], client.cgi_headrs.c_str(), client.cgi_headrs.size());
-                if (written == -1)
-                {
-                    perror("Failed to write CGI headers");
-                }
-            }
-
-            // Write body data
+            client.cgi_stdin.pending = client.cgi_headrs;
             if (!client.request_obj.info_body.empty())
-            {
-                ssize_t written = write(stdin_pipe[1], client.request_obj.info_body.c_str(), client.request_obj.info_body.length());
-                if (written == -1)
-                {
-                    perror("Failed to write body data");
-                }
-            }
+                client.cgi_stdin.pending += client.request_obj.info_body;
             else if (!client.filename.empty())
             {
-                // Fallback: read from file if info_body is empty
-                std::ifstream cgi_body(client.filename.c_str(), std::ios::binary);
-                if (cgi_body.is_open())
-                {
-                    cgi_body.seekg(0, std::ios::end);
-                    std::streamsize file_size = cgi_body.tellg();
-                    cgi_body.seekg(0, std::ios::beg);
-
-                    if (file_size > 0)
-                    {
-
-                        std::string file_content(file_size, '\0');
-                        cgi_body.read(&file_content[0], file_size);
-                        ssize_t written = write(stdin_pipe[1], file_content.c_str(), file_size);
-                        if (written == -1)
-                        {
-                            perror("Failed to write file content");
-                        }
-                    }
-                    cgi_body.close();
-                }
+                // The open fd keeps the file readable after the unlink
+                client.cgi_stdin.body_fd = open(client.filename.c_str(), O_RDONLY | O_CLOEXEC);
+                if (client.cgi_stdin.body_fd == -1)
+                    perror("Failed to open the uploaded body");
                 unlink(client.filename.c_str());
             }
         }
-        close(stdin_pipe[1]); // Close stdin to signal EOF
-
-        // Set pipe to non-blocking mode
-        fcntl(pipefd[0], F_SETFL, O_NONBLOCK);
-        epoll_ctl(client.request_obj.epfd, EPOLL_CTL_ADD, pipefd[0], &ev);
-
-        // Read CGI output with timeout - NO WHILE LOOPS
-        std::string cgi_output;
-        char buffer[4096];
-        time_t start_time;
-        start_time = time(NULL);
-
-        // Use recursive approach or state machine instead of while loop
-        // Classic non-blocking loop for C++98 compatibility
-        bool finished = false;
-        bool timeout_occurred = false;
-        while (!finished && !timeout_occurred)
+        if (write_cgi_input(client))
+            stop_cgi_input(client);
+        else
         {
-            int read_result = read_with_timeout_select(pipefd[0], buffer, sizeof(buffer), CGI_TIMEOUT, start_time, cgi_output);
-            if (read_result > 0)
-            {
-                // Data read, continue
-            }
-            else if (read_result == 0)
+            struct epoll_event in;
+            in.events = EPOLLOUT;
+            in.data.ptr = static_cast<EventHandle *>(&client.cgi_stdin);
+            if (epoll_ctl(client.request_obj.epfd, EPOLL_CTL_ADD, stdin_pipe[1], &in) == -1)
             {
-                // EOF
-                finished = true;
-            }
-            else if (read_result == -2)
-            {
-                // No data available, check timeout and process status
-                if (get_elapsed_seconds(start_time) >= CGI_TIMEOUT)
-                {
-                    timeout_occurred = true;
-                }
-                else if (!is_process_running(pid))
-                {
-                    // Process finished, try one more read then finish
-                    usleep(100000); // 100ms delay
-                    read_result = read_with_timeout_select(pipefd[0], buffer, sizeof(buffer), CGI_TIMEOUT, start_time, cgi_output);
-                    if (read_result <= 0)
-                    {
-                        finished = true;
-                    }
-                }
-                else
-                {
-                    // Just wait a bit
-                    usleep(50000); // 50ms
-                }
-            }
-            else
-            {
-                // Error or timeout
-                timeout_occurred = true;
+                perror("epoll_ctl: add CGI stdin");
+                stop_cgi_input(client);
             }
         }
+
+        // The output is read as it comes, by on_cgi_pipe_event(); the
+        // worker serves other connections meanwhile
+        fcntl(pipefd[0], F_SETFL, O_NONBLOCK);
+        client.cgi_pipe.fd = pipefd[0];
+        client.cgi_pipe.pid = pid;
+        client.cgi_pipe.output.clear();
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.ptr = static_cast<EventHandle *>(&client.cgi_pipe);
+        if (epoll_ctl(client.request_obj.epfd, EPOLL_CTL_ADD, pipefd[0], &ev) == -1)
+        {
+            perror("epoll_ctl: add CGI pipe");
+            stop_cgi(client);
+            std::string error_response = "HTTP/1.1 500 Internal Server Error\r\nContent-Type: text/html\r\nConnection: close\r\n\r\n<h1>500 Internal Server Error</h1>";
+            queue_send(new_socket, error_response.c_str(), error_response.length());
+            finish_request(client);
+        }
+    }
+    else
+    {
+        // Fork failed
+        perror("fork failed");
         close(pipefd[0]);
-        // Handle timeout
-        if (timeout_occurred)
+        close(pipefd[1]);
+        close(stdin_pipe[0]);
+        close(stdin_pipe[1]);
+        std::string error_response = "HTTP/1.1 500 Internal Server Error\r\nContent-Type: text/html\r\nConnection: close\r\n\r\n<h1>500 Internal Server Error</h1>";
+        queue_send(new_socket, error_response.c_str(), error_response.length());
+        finish_request(client);
+    }
+}
+
+// Take what the script wrote since the last wakeup, at most
+// CGI_READ_BUDGET bytes so a chatty script does not hold up the other
+// connections; the pipe is level-triggered and reports the rest again.
+// Returns true once the script closed its output.
+bool read_cgi_output(ChunkedClientInfo &client)
+{
+    char buffer[4096];
+    size_t budget = CGI_READ_BUDGET;
+    while (budget > 0)
+    {
+        ssize_t bytes_read = read(client.cgi_pipe.fd, buffer, std::min(sizeof(buffer), budget));
+        if (bytes_read > 0)
         {
-            std::cerr << "CGI script timeout after " << CGI_TIMEOUT << " seconds" << std::endl;
-            kill(pid, SIGKILL);
-            int status;
-            waitpid(pid, &status, 0);
-            std::string error_response = "HTTP/1.1 504 Gateway Timeout\r\nContent-Type: text/html\r\n\r\n<h1>504 Gateway Timeout</h1><p>CGI script exceeded " + int_to_string(CGI_TIMEOUT) + " second timeout</p>";
-            send(new_socket, error_response.c_str(), error_response.length(), 0);
-            return;
+            client.cgi_pipe.output.append(buffer, bytes_read);
+            budget -= bytes_read;
+            continue;
         }
+        if (bytes_read == 0)
+            return true;
+        if (errno == EINTR)
+            continue;
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+            return false;
+        perror("CGI pipe read failed");
+        return true;
+    }
+    return false;
+}
 
-        // Wait for process to finish if it hasn't already
-        if (is_process_running(pid))
+// Feed the script the body bytes its stdin takes now, at most
+// CGI_WRITE_BUDGET so a large upload does not hold up the other
+// connections; the pipe is level-triggered and reports room again.
+// Returns true once the whole body is written, or the script stopped
+// reading it.
+bool write_cgi_input(ChunkedClientInfo &client)
+{
+    CgiStdinHandle &in = client.cgi_stdin;
+    size_t budget = CGI_WRITE_BUDGET;
+    while (budget > 0)
+    {
+        if (in.sent == in.pending.size())
+        {
+            if (in.body_fd == -1)
+                return true;
+            // Next piece of the upload file
+            in.pending.resize(budget);
+            in.sent = 0;
+            ssize_t bytes_read = read(in.body_fd, &in.pending[0], in.pending.size());
+            in.pending.resize(bytes_read > 0 ? bytes_read : 0);
+            if (bytes_read > 0 || (bytes_read < 0 && errno == EINTR))
+                continue;
+            if (bytes_read < 0)
+                perror("Failed to read the uploaded body");
+            close(in.body_fd);
+            in.body_fd = -1;
+            continue;
+        }
+        ssize_t written = write(in.fd, in.pending.data() + in.sent, std::min(in.pending.size() - in.sent, budget));
+        if (written > 0)
         {
-            int status;
-            waitpid(pid, &status, 0);
+            in.sent += written;
+            budget -= written;
+            continue;
         }
+        if (errno == EINTR)
+            continue;
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+            return false;
+        // EPIPE: the script exited or closed its stdin without the rest
+        if (errno != EPIPE)
+            perror("CGI stdin write failed");
+        return true;
+    }
+    return false;
+}
 
-        // Process CGI output
-        std::string response;
-        size_t header_end = cgi_output.find("\r\n\r\n");
-        bool has_proper_headers = false;
+// Close the script's stdin, which is its EOF, and drop what is left of
+// the body
+void stop_cgi_input(ChunkedClientInfo &client)
+{
+    CgiStdinHandle &in = client.cgi_stdin;
+    if (in.fd != -1)
+    {
+        // Never added when the body went in at once; ENOENT then
+        epoll_ctl(client.request_obj.epfd, EPOLL_CTL_DEL, in.fd, NULL);
+        close(in.fd);
+        in.fd = -1;
+    }
+    if (in.body_fd != -1)
+    {
+        close(in.body_fd);
+        in.body_fd = -1;
+    }
+    std::string().swap(in.pending);
+    in.sent = 0;
+}
 
-        if (header_end == std::string::npos)
+// Close the pipes and collect the script, killing it if it still runs.
+// The output is complete by then, or no longer wanted.
+void stop_cgi(ChunkedClientInfo &client)
+{
+    stop_cgi_input(client);
+    if (client.cgi_pipe.fd != -1)
+    {
+        epoll_ctl(client.request_obj.epfd, EPOLL_CTL_DEL, client.cgi_pipe.fd, NULL);
+        close(client.cgi_pipe.fd);
+        client.cgi_pipe.fd = -1;
+    }
+    if (client.cgi_pipe.pid > 0)
+    {
+        if (waitpid(client.cgi_pipe.pid, NULL, WNOHANG) == 0)
         {
-            header_end = cgi_output.find("\n\n");
-            if (header_end != std::string::npos)
-            {
-                std::string headers_part = cgi_output.substr(0, header_end);
-                std::string body_part = cgi_output.substr(header_end + 2);
-
-                // Check if headers contain Content-Type
-                if (headers_part.find("Content-Type") != std::string::npos ||
-                    headers_part.find("content-type") != std::string::npos)
-                {
-                    has_proper_headers = true;
-                    // Normalize line endings
-                    for (size_t i = 0; i < headers_part.length(); ++i)
-                    {
-                        if (headers_part[i] == '\n' && (i == 0 || headers_part[i - 1] != '\r'))
-                        {
-                            headers_part.insert(i, "\r");
-                            ++i;
-                        }
-                    }
-                    response = "HTTP/1.1 200 OK\r\n" + headers_part + "\r\n\r\n" + body_part;
-                }
-            }
+            kill(client.cgi_pipe.pid, SIGKILL);
+            waitpid(client.cgi_pipe.pid, NULL, 0);
         }
-        else
+        client.cgi_pipe.pid = 0;
+    }
+}
+
+// The script closed its output: answer with what it wrote
+void finish_cgi_request(ChunkedClientInfo &client, int new_socket)
+{
+    stop_cgi(client);
+    std::string cgi_output;
+    cgi_output.swap(client.cgi_pipe.output);
+
+    // Process CGI output
+    std::string response;
+    size_t header_end = cgi_output.find("\r\n\r\n");
+    bool has_proper_headers = false;
+
+    if (header_end == std::string::npos)
+    {
+        header_end = cgi_output.find("\n\n");
+        if (header_end != std::string::npos)
         {
             std::string headers_part = cgi_output.substr(0, header_end);
+            std::string body_part = cgi_output.substr(header_end + 2);
+
+            // Check if headers contain Content-Type
             if (headers_part.find("Content-Type") != std::string::npos ||
                 headers_part.find("content-type") != std::string::npos)
             {
                 has_proper_headers = true;
-                response = "HTTP/1.1 200 OK\r\n" + cgi_output;
+                // Normalize line endings
+                for (size_t i = 0; i < headers_part.length(); ++i)
+                {
+                    if (headers_part[i] == '\n' && (i == 0 || headers_part[i - 1] != '\r'))
+                    {
+                        headers_part.insert(i, "\r");
+                        ++i;
+                    }
+                }
+                response = "HTTP/1.1 200 OK\r\n" + headers_part + "\r\n\r\n" + body_part;
             }
         }
-
-        // If no proper headers found, treat entire output as body content
-        if (!has_proper_headers || response.empty())
+    }
+    else
+    {
+        std::string headers_part = cgi_output.substr(0, header_end);
+        if (headers_part.find("Content-Type") != std::string::npos ||
+            headers_part.find("content-type") != std::string::npos)
         {
-            response = "HTTP/1.1 200 OK\r\n";
-            response += "Content-Type: text/html\r\n\r\n";
-            response += cgi_output;
+            has_proper_headers = true;
+            response = "HTTP/1.1 200 OK\r\n" + cgi_output;
         }
-
-        send(new_socket, response.c_str(), response.length(), 0);
     }
-    else
+
+    // If no proper headers found, treat entire output as body content
+    if (!has_proper_headers || response.empty())
     {
-        // Fork failed
-        perror("fork failed");
-        close(pipefd[0]);
-        close(pipefd[1]);
-        close(stdin_pipe[0]);
-        close(stdin_pipe[1]);
-        std::string error_response = "HTTP/1.1 500 Internal Server Error\r\nContent-Type: text/html\r\n\r\n<h1>500 Internal Server Error</h1>";
-        send(new_socket, error_response.c_str(), error_response.length(), 0);
+        response = "HTTP/1.1 200 OK\r\n";
+        response += "Content-Type: text/html\r\n\r\n";
+        response += cgi_output;
     }
-}
\ No newline at end of file
+    response.insert(response.find("\r\n") + 2, "Connection: close\r\n");
+
+    queue_send(new_socket, response.c_str(), response.length());
+    finish_request(client);
+}
+
+// The script ran past CGI_TIMEOUT
+void cgi_timed_out(ChunkedClientInfo &client, int new_socket)
+{
+    std::cerr << "CGI script timeout after " << CGI_TIMEOUT << " seconds" << std::endl;
+    stop_cgi(client);
+    client.cgi_pipe.output.clear();
+    std::string error_response = "HTTP/1.1 504 Gateway Timeout\r\nContent-Type: text/html\r\nConnection: close\r\n\r\n<h1>504 Gateway Timeout</h1><p>CGI script exceeded " + int_to_string(CGI_TIMEOUT) + " second timeout</p>";
+    queue_send(new_socket, error_response.c_str(), error_response.length());
+    finish_request(client);
+}
@@ -1,74 +1,69 @@
 #include "server.hpp"
+#include <sys/sendfile.h>
+#include <algorithm>
 
-bool sendDataReliably(int fd, const char *data, size_t size)
+// Queue response bytes on the connection owning fd. The event loop writes
+// them once the handler returns, and waits for EPOLLOUT when the socket is
+// full. Returns false once the peer is gone.
+bool queue_send(int fd, const char *data, size_t size)
 {
-    ssize_t total_sent = 0;
-    int retry_count = 0;
-    const int max_retries = 100;
+    ChunkedClientInfo *client = find_current_client(fd);
+    if (!client)
+        return send(fd, data, size, MSG_NOSIGNAL | MSG_DONTWAIT) == static_cast<ssize_t>(size);
 
-    while (total_sent < static_cast<ssize_t>(size) && retry_count < max_retries)
+    client->output.append(data, size);
+    // Large responses are pushed out early so the queue only keeps what the
+    // socket could not take. I/O threads only fill the queue of their copy.
+    if (client->output.size() >= OUTPUT_FLUSH_THRESHOLD && !on_io_thread())
     {
-        ssize_t sent = send(fd, data + total_sent, size - total_sent, MSG_NOSIGNAL | MSG_DONTWAIT);
-        if (sent == -1)
-        {
-            usleep(100);
-            retry_count++;
-            continue;
-        }
-        if (sent == 0)
+        ssize_t sent = client->output.flush(fd);
+        if (sent < 0)
         {
-            return false; // Connection closed
+            client->output.clear();
+            client->is_active = false;
+            return false;
         }
-        total_sent += sent;
-        retry_count = 0;
     }
+    return true;
+}
 
-    return (total_sent == static_cast<ssize_t>(size));
+// Connection header for the response being written on fd
+std::string connection_header(int fd)
+{
+    ChunkedClientInfo *client = find_current_client(fd);
+    if (client && response_keeps_alive(*client))
+        return "Connection: keep-alive\r\n";
+    return "Connection: close\r\n";
 }
-// Thread-safe chunk sending with non-blocking I/O support
+
+bool sendDataReliably(int fd, const char *data, size_t size)
+{
+    return queue_send(fd, data, size);
+}
+
+// Queue one chunk of a chunked response; size 0 ends the body
 void sendChunk(int fd, const char *data, size_t size)
 {
     if (size == 0)
     {
         // Final chunk (indicates end of transmission)
         const char *finalChunk = "0\r\n\r\n";
-        send(fd, finalChunk, strlen(finalChunk), MSG_NOSIGNAL);
+        queue_send(fd, finalChunk, strlen(finalChunk));
         return;
     }
 
-    // 1. Send the size header in hex + CRLF
+    // Size header in hex, the data, then the CRLF trailer
     std::ostringstream chunkHeader;
     chunkHeader << std::hex << size << "\r\n";
     std::string header = chunkHeader.str();
-    send(fd, header.c_str(), header.length(), MSG_NOSIGNAL);
-
-    // 2. Send the actual data with retry logic
-    ssize_t total_sent = 0;
-    int retry_count = 0;
-    const int max_retries = 100;
-
-    while (total_sent < static_cast<ssize_t>(size) && retry_count < max_retries)
-    {
-        ssize_t sent = send(fd, data + total_sent, size - total_sent, MSG_NOSIGNAL | MSG_DONTWAIT);
-
-        if (sent <= 0)
-        {
-            usleep(100); // sleep for 0.1ms
-            retry_count++;
-            continue;
-        }
-
-        total_sent += sent;
-        retry_count = 0; // reset on success
-    }
-
-    // 3. Send trailer (CRLF)
-    send(fd, "\r\n", 2, MSG_NOSIGNAL);
+    queue_send(fd, header.c_str(), header.length());
+    queue_send(fd, data, size);
+    queue_send(fd, "\r\n", 2);
 }
-void response_plus(std::string name_file, int fd, std::string header, std::map<std::string, std::string> &headers)
+void response_plus(std::string name_file, int fd, std::string header, const std::string &range)
 {
-    std::ifstream file(name_file.c_str(), std::ios::binary);
-    if (!file.is_open())
+    int file_fd = open(name_file.c_str(), O_RDONLY | O_CLOEXEC);
+    if (file_fd == -1)
     {
         sendErrorResponse(fd, 404, "Not Found", "error_page/404.html");
         return;
@@ -77,19 +72,22 @@ void response_plus(std::string name_file, int fd, std::string header, std::map<s
     long fileSize = getFileSize(name_file);
     if (fileSize == -1)
     {
-        file.close();
+        close(file_fd);
         sendErrorResponse(fd, 500, "Internal Server Error", "error_page/500.html");
         return;
     }
 
     // Check for Range header (for video seeking support)
-    std::map<std::string, std::string>::const_iterator rangeIt = headers.find("Range");
     bool isPartialContent = false;
     long start = 0, end = fileSize - 1;
 
-    if (rangeIt != headers.end() && parseRangeHeader(rangeIt->second, fileSize, start, end))
+    // A range that fails to parse leaves the whole file to send
+    long range_start, range_end;
+    if (!range.empty() && parseRangeHeader(range, fileSize, range_start, range_end))
     {
         isPartialContent = true;
+        start = range_start;
+        end = range_end;
     }
 
     // For video files, support partial content requests
@@ -100,94 +98,160 @@ void response_plus(std::string name_file, int fd, std::string header, std::map<s
 
     if (isPartialContent)
     {
+        // The 206 status line replaces the 200 one the caller prepared
+        size_t line_end = header.find("\r\n");
+        if (line_end != std::string::npos)
+            header.erase(0, line_end + 2);
         oss << "HTTP/1.1 206 Partial Content\r\n";
+        oss << header;
         oss << "Content-Range: bytes " << start << "-" << end << "/" << fileSize << "\r\n";
         oss << "Content-Length: " << (end - start + 1) << "\r\n";
         oss << "Accept-Ranges: bytes\r\n";
-        oss << "Connection: close\r\n\r\n";
-        header += oss.str();
+        oss << connection_header(fd) << "\r\n";
+        header = oss.str();
     }
     else if (isVideo)
     {
         // For video files, always include Accept-Ranges even for full content
-        // oss << "HTTP/1.1 200 OK\r\n";
         oss << "Content-Length: " << fileSize << "\r\n";
         oss << "Accept-Ranges: bytes\r\n";
-        oss << "Connection: close\r\n\r\n";
+        oss << connection_header(fd) << "\r\n";
         header += oss.str();
     }
     else
     {
         // Use chunked encoding for non-video files
-        // oss << "HTTP/1.1 200 OK\r\n";
         oss << "Transfer-Encoding: chunked\r\n";
-        oss << "Connection: close\r\n\r\n";
+        oss << connection_header(fd) << "\r\n";
         header += oss.str();
     }
 
-    const char *new_head = header.c_str();
-    send(fd, new_head, strlen(new_head), MSG_NOSIGNAL);
+    queue_send(fd, header.c_str(), header.length());
 
-    // Seek to start position for partial content
-    if (isPartialContent || start > 0)
+    // The body is sent by the worker as the socket accepts it
+    ChunkedClientInfo *client = find_current_client(fd);
+    TransferFraming framing = (isVideo || isPartialContent) ? FRAMING_LENGTH : FRAMING_CHUNKED;
+    // An empty file announced with Content-Length: 0 has nothing to send;
+    // sendfile() would return 0 and look like the file shrank
+    if (!client || (framing == FRAMING_LENGTH && end < start))
     {
-        file.seekg(start);
+        close(file_fd);
+        return;
     }
+    client->transfer.close();
+    client->transfer.fd = file_fd;
+    client->transfer.offset = start;
+    client->transfer.end = end + 1;
+    client->transfer.framing = framing;
+}
 
-    long remainingBytes = end - start + 1;
+// Copy the file transfer into the output queue, framed as the response
+// announced, while the queue holds less than limit bytes. Returns true once
+// the whole body is queued and the transfer is closed.
+bool queue_transfer(ChunkedClientInfo &client, size_t limit)
+{
+    FileTransfer &transfer = client.transfer;
     char buffer[BUFFER_SIZE];
-
-    // Enhanced sending logic with better error handling for concurrent clients
-    if (isVideo && !isPartialContent)
+    while (transfer.offset < transfer.end && client.output.size() < limit)
     {
-        // For full video content, send with Content-Length (no chunking)
-        while (file.read(buffer, sizeof(buffer)) || file.gcount() > 0)
+        size_t want = std::min(sizeof(buffer), static_cast<size_t>(transfer.end - transfer.offset));
+        ssize_t bytesRead = pread(transfer.fd, buffer, want, transfer.offset);
+        if (bytesRead < 0 && errno == EINTR)
+            continue;
+        if (bytesRead <= 0 && transfer.framing == FRAMING_LENGTH)
         {
-            size_t bytesRead = file.gcount();
-
-            if (!sendDataReliably(fd, buffer, bytesRead))
-            {
-                file.close();
-                return;
-            }
+            // The file shrank: the promised Content-Length can not be met
+            std::cerr << "File ended before the announced length" << std::endl;
+            transfer.close();
+            client.is_active = false;
+            return false;
         }
+        if (bytesRead <= 0)
+        {
+            // Stop at what the file really holds
+            transfer.end = transfer.offset;
+            break;
+        }
+        if (transfer.framing == FRAMING_CHUNKED)
+        {
+            std::ostringstream chunkHeader;
+            chunkHeader << std::hex << bytesRead << "\r\n";
+            std::string chunk = chunkHeader.str();
+            client.output.append(chunk.data(), chunk.size());
+            client.output.append(buffer, bytesRead);
+            client.output.append("\r\n", 2);
+        }
+        else
+            client.output.append(buffer, bytesRead);
+        transfer.offset += bytesRead;
     }
-    else if (isPartialContent)
+    if (transfer.offset < transfer.end)
+        return false;
+    if (transfer.framing == FRAMING_CHUNKED)
+        client.output.append("0\r\n\r\n", 5);
+    transfer.close();
+    return true;
+}
+
+// Move the client's pending output, then its file transfer, into the socket
+// until the socket is full, everything is sent or about `budget` bytes went
+// out. Returns the bytes written, or -1 when the connection can not continue.
+ssize_t write_client(ChunkedClientInfo &client, size_t budget)
+{
+    FileTransfer &transfer = client.transfer;
+    ssize_t total = 0;
+
+    while (static_cast<size_t>(total) < budget)
     {
-        // Send partial content with Content-Length
-        while (remainingBytes > 0 && (file.read(buffer, std::min(static_cast<long>(sizeof(buffer)), remainingBytes)) || file.gcount() > 0))
+        if (!client.output.empty())
         {
-            size_t bytesRead = file.gcount();
-            remainingBytes -= bytesRead;
+            ssize_t sent = client.output.flush(client.fd);
+            if (sent < 0)
+                return -1;
+            total += sent;
+            if (!client.output.empty())
+                break; // Socket is full
+        }
+        if (!transfer.active())
+            break;
 
-            if (!sendDataReliably(fd, buffer, bytesRead))
+        if (transfer.framing == FRAMING_LENGTH)
+        {
+            off_t offset = transfer.offset;
+            size_t want = std::min(static_cast<size_t>(transfer.end - transfer.offset), budget - total);
+            ssize_t sent = sendfile(client.fd, transfer.fd, &offset, want);
+            if (sent < 0)
+            {
+                if (errno == EINTR)
+                    continue;
+                if (errno == EAGAIN || errno == EWOULDBLOCK)
+                    break;
+                return -1;
+            }
+            if (sent == 0)
             {
-                file.close();
-                return;
+                // The file shrank: the promised Content-Length can not be met
+                std::cerr << "File ended before the announced length" << std::endl;
+                return -1;
             }
+            transfer.offset = offset;
+            total += sent;
+            if (transfer.offset >= transfer.end)
+                transfer.close();
         }
-    }
-    else
-    {
-        // Use chunked encoding for other files
-        while (file.read(buffer, sizeof(buffer)) || file.gcount() > 0)
+        else
         {
-            size_t bytesRead = file.gcount();
-            sendChunk(fd, buffer, bytesRead);
+            // Frame file data into the queue; the next round writes it
+            queue_transfer(client, OUTPUT_FLUSH_THRESHOLD);
         }
-
-        // Send final chunk to indicate end of transfer
-        sendChunk(fd, NULL, 0);
     }
-
-    file.close();
+    return total;
 }
 
-// Overloaded version with empty headers map as default
+// The whole file, whatever range was asked for
 void response(std::string name_file, int fd, std::string header)
 {
-    std::map<std::string, std::string> empty_headers;
-    response_plus(name_file, fd, header, empty_headers);
+    response_plus(name_file, fd, header, std::string());
 }
 
 // POST response function with enhanced concurrent handling
@@ -203,11 +267,11 @@ void response_post(std::string name_file, int fd, std::string header)
     // Send existing file with chunked encoding
     std::ostringstream oss;
     oss << "Transfer-Encoding: chunked\r\n";
-    oss << "Connection: close\r\n\r\n";
+    oss << connection_header(fd) << "\r\n";
     header += oss.str();
 
     const char *new_head = header.c_str();
-    send(fd, new_head, strlen(new_head), MSG_NOSIGNAL);
+    queue_send(fd, new_head, strlen(new_head));
 
     char buffer[BUFFER_SIZE];
 
@@ -0,0 +1,191 @@
+#include "server.hpp"
+#include <algorithm>
+
+template <class T>
+SlabPool<T>::SlabPool()
+{
+}
+
+// Pools belong to one table and are never shared: a copy starts empty
+template <class T>
+SlabPool<T>::SlabPool(const SlabPool &other)
+{
+    (void)other;
+}
+
+template <class T>
+SlabPool<T> &SlabPool<T>::operator=(const SlabPool &other)
+{
+    (void)other;
+    return *this;
+}
+
+template <class T>
+SlabPool<T>::~SlabPool()
+{
+    for (size_t i = 0; i < slabs.size(); ++i)
+        delete[] slabs[i];
+}
+
+// Hand out the most recently released object (still warm in cache). When
+// the free list is empty, carve a new slab.
+template <class T>
+T *SlabPool<T>::acquire()
+{
+    if (free_list.empty())
+        reserve(1);
+    T *object = free_list.back();
+    free_list.pop_back();
+    return object;
+}
+
+// Carve slabs until count objects are free, so they are allocated, and
+// first touched, by the thread that calls this
+template <class T>
+void SlabPool<T>::reserve(size_t count)
+{
+    while (free_list.size() < count)
+    {
+        T *slab = new T[CONNECTION_SLAB_SIZE];
+        slabs.push_back(slab);
+        free_list.reserve(slabs.size() * CONNECTION_SLAB_SIZE);
+        for (size_t i = CONNECTION_SLAB_SIZE; i > 0; --i)
+            free_list.push_back(&slab[i - 1]);
+    }
+}
+
+// Reset the object so it holds no file or stale request state, and keep
+// its buffers for the next connection
+template <class T>
+void SlabPool<T>::release(T *object)
+{
+    object->reset();
+    free_list.push_back(object);
+}
+
+template class SlabPool<ChunkedClientInfo>;
+template class SlabPool<PendingClient>;
+
+ClientTable::ClientTable() : active(0)
+{
+}
+
+// Tables belong to one worker and are never shared: a copy starts empty
+ClientTable::ClientTable(const ClientTable &other) : active(0)
+{
+    (void)other;
+}
+
+ClientTable &ClientTable::operator=(const ClientTable &other)
+{
+    (void)other;
+    return *this;
+}
+
+ClientTable::~ClientTable()
+{
+}
+
+// Claim the slot for a freshly accepted fd. The table grows
+// geometrically, so growth is rare.
+ClientSlot *ClientTable::claim(int fd)
+{
+    if (fd < 0)
+        return NULL;
+    if (static_cast<size_t>(fd) >= slots.size())
+        slots.resize(std::max(static_cast<size_t>(fd) + 1, slots.size() * 2));
+
+    ClientSlot &slot = slots[fd];
+    if (slot.in_use)
+        return NULL;
+    slot.in_use = true;
+    active++;
+    return &slot;
+}
+
+// Give a freshly accepted fd a clean connection object from the pool
+ChunkedClientInfo *ClientTable::open(int fd)
+{
+    ClientSlot *slot = claim(fd);
+    if (!slot)
+        return NULL;
+    slot->client = pool.acquire();
+    slot->client->generation = slot->generation;
+    return slot->client;
+}
+
+// Give a freshly accepted fd only a pending record, until it sends data
+PendingClient *ClientTable::open_pending(int fd)
+{
+    ClientSlot *slot = claim(fd);
+    if (!slot)
+        return NULL;
+    slot->pending = pending_pool.acquire();
+    slot->pending->generation = slot->generation;
+    return slot->pending;
+}
+
+// Replace the pending record of fd with a clean connection object. The
+// slot keeps its generation, so references taken meanwhile stay valid.
+// The caller copies what it needs out of the pending record first.
+ChunkedClientInfo *ClientTable::promote(int fd)
+{
+    if (!find_pending(fd))
+        return NULL;
+    ClientSlot &slot = slots[fd];
+    pending_pool.release(slot.pending);
+    slot.pending = NULL;
+    slot.client = pool.acquire();
+    slot.client->generation = slot.generation;
+    return slot.client;
+}
+
+// NULL for a free slot and for a connection still pending
+ChunkedClientInfo *ClientTable::find(int fd) const
+{
+    if (fd < 0 || static_cast<size_t>(fd) >= slots.size() || !slots[fd].in_use)
+        return NULL;
+    return slots[fd].client;
+}
+
+// NULL when the connection behind ref has been closed, even if the fd has
+// since been reused
+ChunkedClientInfo *ClientTable::find(const ClientRef &ref) const
+{
+    if (ref.fd < 0 || static_cast<size_t>(ref.fd) >= slots.size())
+        return NULL;
+    const ClientSlot &slot = slots[ref.fd];
+    if (!slot.in_use || slot.generation != ref.generation)
+        return NULL;
+    return slot.client;
+}
+
+PendingClient *ClientTable::find_pending(int fd) const
+{
+    if (fd < 0 || static_cast<size_t>(fd) >= slots.size() || !slots[fd].in_use)
+        return NULL;
+    return slots[fd].pending;
+}
+
+PendingClient *ClientTable::find_pending(const ClientRef &ref) const
+{
+    PendingClient *pending = find_pending(ref.fd);
+    if (!pending || pending->generation != ref.generation)
+        return NULL;
+    return pending;
+}
+
+void ClientTable::release(int fd)
+{
+    if (fd < 0 || static_cast<size_t>(fd) >= slots.size() || !slots[fd].in_use)
+        return;
+    if (slots[fd].pending)
+        pending_pool.release(slots[fd].pending);
+    else
+        pool.release(slots[fd].client);
+    slots[fd].client = NULL;
+    slots[fd].pending = NULL;
+    slots[fd].in_use = false;
+    slots[fd].generation++;
+    active--;
+}
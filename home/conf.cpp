@@ -11,6 +11,7 @@
 #include <map>
 #include <set>
 #include <climits>
+#include <sched.h>
 
 #include "server.hpp"
 
@@ -29,7 +30,7 @@ bool endsWithSemicolon(const std::string &str)
     return !str.empty() && str[str.length() - 1] == ';';
 }
 
-std::vector<ServerConfig> check_configfile()
+std::vector<ServerConfig> check_configfile(GlobalConfig &global)
 {
     std::ifstream inputFile("configfile.conf");
     if (!inputFile.is_open())
@@ -58,6 +59,21 @@ std::vector<ServerConfig> check_configfile()
     allowedLocationDirectives.insert("cgi_path");
     allowedLocationDirectives.insert("redirection");
 
+    // Directives allowed outside of any server block
+    std::set<std::string> allowedGlobalDirectives;
+    allowedGlobalDirectives.insert("worker_threads");
+    allowedGlobalDirectives.insert("worker_processes");
+    allowedGlobalDirectives.insert("edge_triggered");
+    allowedGlobalDirectives.insert("read_budget");
+    allowedGlobalDirectives.insert("event_backend");
+    allowedGlobalDirectives.insert("keepalive_timeout");
+    allowedGlobalDirectives.insert("keepalive_requests");
+    allowedGlobalDirectives.insert("io_threads");
+    allowedGlobalDirectives.insert("worker_cpu_affinity");
+    allowedGlobalDirectives.insert("overload_lag");
+    allowedGlobalDirectives.insert("overload_queue");
+    allowedGlobalDirectives.insert("overload_retry_after");
+
     // Directives that require special treatment for semicolon checking
     std::set<std::string> specialDirectives;
     specialDirectives.insert("location");
@@ -143,6 +159,7 @@ std::vector<ServerConfig> check_configfile()
             {
                 currentServer = ServerConfig();
                 currentServer.port = 80;                          // Default port
+                currentServer.backlog = LISTEN_BACKLOG;
                 currentServer.host = "localhost";                 // Default host
             }
         }
@@ -156,8 +173,12 @@ std::vector<ServerConfig> check_configfile()
                     // Validate required directives before closing location block
                     if (currentLocation != NULL)
                     {
+                        // Without a method directive every method is allowed
+                        if (currentLocation->allowed_methods == 0)
+                            currentLocation->allowed_methods = METHODS_ALL;
+
                         // Check for missing required directives
-                        // if (currentLocation->methods.empty())
+                        // if (currentLocation->allowed_methods == 0)
                         // {
                         //     std::cerr << "Error: Location block '" << currentLocation->path
                         //               << "' is missing required 'method' directive" << std::endl;
@@ -263,7 +284,7 @@ std::vector<ServerConfig> check_configfile()
                                 singleMethod.erase(singleMethod.size() - 1, 1);
 
                             if (!singleMethod.empty())
-                                currentLocation->methods.push_back(singleMethod);
+                                currentLocation->allowed_methods |= method_from_name(singleMethod.data(), singleMethod.size());
                         }
                     }
                 }
@@ -420,6 +441,38 @@ std::vector<ServerConfig> check_configfile()
                                   << currentServer.port << std::endl;
                         return std::vector<ServerConfig>();
                     }
+
+                    // Optional parameters: backlog=N
+                    std::string param;
+                    while (iss >> param)
+                    {
+                        param = removeSemicolon(param);
+                        if (param.empty())
+                            continue;
+                        if (param.compare(0, 8, "backlog=") != 0)
+                        {
+                            std::cerr << "Error: Line " << lineNumber << ": Unknown listen parameter: "
+                                      << param << std::endl;
+                            return std::vector<ServerConfig>();
+                        }
+                        std::string value = param.substr(8);
+                        for (size_t i = 0; i < value.length(); i++)
+                        {
+                            if (!isdigit(value[i]))
+                            {
+                                value.clear();
+                                break;
+                            }
+                        }
+                        long backlog = value.empty() ? 0 : atol(value.c_str());
+                        if (backlog < 1 || backlog > 65535)
+                        {
+                            std::cerr << "Error: Line " << lineNumber << ": Invalid backlog (1-65535): "
+                                      << param.substr(8) << std::endl;
+                            return std::vector<ServerConfig>();
+                        }
+                        currentServer.backlog = backlog;
+                    }
                 }
                 else if (directive == "host")
                 {
@@ -689,9 +742,222 @@ std::vector<ServerConfig> check_configfile()
         }
         else
         {
-            std::cerr << "Error: Line " << lineNumber << ": Unexpected content outside of server block: '"
-                      << cleanLine << "'" << std::endl;
-            return std::vector<ServerConfig>();
+            std::istringstream iss(cleanLine);
+            std::string directive;
+            iss >> directive;
+
+            if (allowedGlobalDirectives.find(directive) == allowedGlobalDirectives.end())
+            {
+                std::cerr << "Error: Line " << lineNumber << ": Unexpected content outside of server block: '"
+                          << cleanLine << "'" << std::endl;
+                return std::vector<ServerConfig>();
+            }
+
+            if (!endsWithSemicolon(cleanLine))
+            {
+                std::cerr << "Error: Line " << lineNumber << ": Missing semicolon at the end of directive: '"
+                          << originalLine << "'" << std::endl;
+                return std::vector<ServerConfig>();
+            }
+
+            if (directive == "worker_threads" || directive == "worker_processes")
+            {
+                std::string value;
+                int count;
+                iss >> value;
+                value = removeSemicolon(value);
+
+                if (value == "auto")
+                {
+                    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+                    count = (cpus > 0) ? (int)cpus : 1;
+                }
+                else
+                {
+                    for (size_t i = 0; i < value.length(); i++)
+                    {
+                        if (!isdigit(value[i]))
+                        {
+                            std::cerr << "Error: Line " << lineNumber << ": Invalid " << directive << " value: "
+                                      << value << std::endl;
+                            return std::vector<ServerConfig>();
+                        }
+                    }
+                    count = atoi(value.c_str());
+                }
+
+                if (count <= 0 || count > 1024)
+                {
+                    std::cerr << "Error: Line " << lineNumber << ": " << directive << " out of range (1-1024): "
+                              << value << std::endl;
+                    return std::vector<ServerConfig>();
+                }
+
+                if (directive == "worker_threads")
+                    global.worker_threads = count;
+                else
+                    global.worker_processes = count;
+            }
+            else if (directive == "edge_triggered")
+            {
+                std::string value;
+                iss >> value;
+                value = removeSemicolon(value);
+
+                if (value != "on" && value != "off")
+                {
+                    std::cerr << "Error: Line " << lineNumber << ": Invalid edge_triggered value '"
+                              << value << "'. Must be 'on' or 'off'" << std::endl;
+                    return std::vector<ServerConfig>();
+                }
+                global.edge_triggered = (value == "on");
+            }
+            else if (directive == "event_backend")
+            {
+                std::string value;
+                iss >> value;
+                value = removeSemicolon(value);
+
+                if (value != "epoll" && value != "io_uring")
+                {
+                    std::cerr << "Error: Line " << lineNumber << ": Invalid event_backend value '"
+                              << value << "'. Must be 'epoll' or 'io_uring'" << std::endl;
+                    return std::vector<ServerConfig>();
+                }
+                global.io_uring = (value == "io_uring");
+            }
+            else if (directive == "worker_cpu_affinity")
+            {
+                // "auto": one CPU the process may use per worker; "off"; or
+                // CPUs and ranges ("0 2 4-7") handed to the workers in order
+                std::vector<std::string> values;
+                std::string value;
+                while (iss >> value)
+                {
+                    value = removeSemicolon(value);
+                    if (!value.empty())
+                        values.push_back(value);
+                }
+                if (values.empty())
+                {
+                    std::cerr << "Error: Line " << lineNumber << ": Missing value for worker_cpu_affinity" << std::endl;
+                    return std::vector<ServerConfig>();
+                }
+                global.worker_cpus.clear();
+                if (values.size() == 1 && values[0] == "auto")
+                    global.worker_cpus = allowed_cpus();
+                else if (!(values.size() == 1 && values[0] == "off"))
+                {
+                    for (size_t v = 0; v < values.size(); ++v)
+                    {
+                        const std::string &range = values[v];
+                        size_t dash = range.find('-');
+                        std::string first = range.substr(0, dash);
+                        std::string last = (dash == std::string::npos) ? first : range.substr(dash + 1);
+                        bool digits = !first.empty() && !last.empty();
+                        for (size_t i = 0; i < first.length(); i++)
+                            digits = digits && isdigit(first[i]);
+                        for (size_t i = 0; i < last.length(); i++)
+                            digits = digits && isdigit(last[i]);
+                        int low = atoi(first.c_str());
+                        int high = atoi(last.c_str());
+                        if (!digits || low > high || high >= CPU_SETSIZE)
+                        {
+                            std::cerr << "Error: Line " << lineNumber << ": Invalid worker_cpu_affinity value '"
+                                      << range << "'. Use 'auto', 'off' or CPU numbers and ranges" << std::endl;
+                            return std::vector<ServerConfig>();
+                        }
+                        for (int cpu = low; cpu <= high; ++cpu)
+                            global.worker_cpus.push_back(cpu);
+                    }
+                }
+            }
+            else if (directive == "read_budget")
+            {
+                std::string value;
+                iss >> value;
+                value = removeSemicolon(value);
+
+                if (value.empty())
+                {
+                    std::cerr << "Error: Line " << lineNumber << ": Missing value for read_budget" << std::endl;
+                    return std::vector<ServerConfig>();
+                }
+                for (size_t i = 0; i < value.length(); i++)
+                {
+                    if (!isdigit(value[i]))
+                    {
+                        std::cerr << "Error: Line " << lineNumber << ": Invalid read_budget value: "
+                                  << value << std::endl;
+                        return std::vector<ServerConfig>();
+                    }
+                }
+                global.read_budget = atoll(value.c_str());
+                if (global.read_budget < CHUNK_SIZE)
+                {
+                    std::cerr << "Error: Line " << lineNumber << ": read_budget must be at least "
+                              << CHUNK_SIZE << " bytes" << std::endl;
+                    return std::vector<ServerConfig>();
+                }
+            }
+            else if (directive == "keepalive_timeout" || directive == "keepalive_requests" ||
+                     directive == "io_threads" || directive == "overload_lag" ||
+                     directive == "overload_queue" || directive == "overload_retry_after")
+            {
+                std::string value;
+                iss >> value;
+                value = removeSemicolon(value);
+
+                if (value.empty())
+                {
+                    std::cerr << "Error: Line " << lineNumber << ": Missing value for " << directive << std::endl;
+                    return std::vector<ServerConfig>();
+                }
+                for (size_t i = 0; i < value.length(); i++)
+                {
+                    if (!isdigit(value[i]))
+                    {
+                        std::cerr << "Error: Line " << lineNumber << ": Invalid " << directive << " value: "
+                                  << value << std::endl;
+                        return std::vector<ServerConfig>();
+                    }
+                }
+                long count = atol(value.c_str());
+                // A timeout of 0 turns keep-alive off; a connection serves at least one request;
+                // 0 I/O threads prepares every response on the event loop; an overload
+                // threshold of 0 is never reached
+                bool in_range;
+                if (directive == "keepalive_timeout")
+                    in_range = (count <= 3600);
+                else if (directive == "keepalive_requests")
+                    in_range = (count >= 1 && count <= 100000);
+                else if (directive == "overload_lag")
+                    in_range = (count <= 60000);
+                else if (directive == "overload_queue")
+                    in_range = (count <= 1000000);
+                else if (directive == "overload_retry_after")
+                    in_range = (count >= 1 && count <= 3600);
+                else
+                    in_range = (count <= 256);
+                if (!in_range)
+                {
+                    std::cerr << "Error: Line " << lineNumber << ": " << directive << " out of range: "
+                              << value << std::endl;
+                    return std::vector<ServerConfig>();
+                }
+                if (directive == "keepalive_timeout")
+                    global.keepalive_timeout = (int)count;
+                else if (directive == "keepalive_requests")
+                    global.keepalive_requests = (int)count;
+                else if (directive == "overload_lag")
+                    global.overload_lag = (int)count;
+                else if (directive == "overload_queue")
+                    global.overload_queue = (int)count;
+                else if (directive == "overload_retry_after")
+                    global.overload_retry_after = (int)count;
+                else
+                    global.io_threads = (int)count;
+            }
         }
     }
 
@@ -0,0 +1,122 @@
+#include "server.hpp"
+#include <signal.h>
+#include <algorithm>
+
+// The published configuration. Readers take a reference under the lock,
+// so a snapshot cannot be freed between reading the pointer and counting
+// the reference; reference counts themselves are atomic, since the last
+// connection of a snapshot may close on any worker thread.
+static pthread_mutex_t config_lock = PTHREAD_MUTEX_INITIALIZER;
+static ConfigSnapshot *current_config = NULL;
+static volatile unsigned config_generation = 0;
+static std::vector<int> config_watchers; // eventfds of the workers to wake on a reload
+
+static volatile sig_atomic_t reload_requested = 0;
+
+ConfigSnapshot *acquire_config()
+{
+    pthread_mutex_lock(&config_lock);
+    ConfigSnapshot *config = current_config;
+    retain_config(config);
+    pthread_mutex_unlock(&config_lock);
+    return config;
+}
+
+void retain_config(ConfigSnapshot *config)
+{
+    if (config)
+        __sync_add_and_fetch(&config->refs, 1);
+}
+
+void release_config(ConfigSnapshot *config)
+{
+    if (config && __sync_sub_and_fetch(&config->refs, 1) == 0)
+        delete config;
+}
+
+// Make config the one new requests use. The caller's reference becomes
+// the published one; the previous snapshot loses its published reference
+// and lives on while requests still run on it. Returns the generation.
+unsigned publish_config(ConfigSnapshot *config)
+{
+    pthread_mutex_lock(&config_lock);
+    ConfigSnapshot *previous = current_config;
+    unsigned generation = config_generation + 1;
+    config->generation = generation;
+    current_config = config;
+    config_generation = config->generation;
+    std::vector<int> watchers(config_watchers);
+    pthread_mutex_unlock(&config_lock);
+
+    release_config(previous);
+    uint64_t one = 1;
+    for (size_t i = 0; i < watchers.size(); ++i)
+    {
+        if (write(watchers[i], &one, sizeof(one)) < 0 && errno != EAGAIN)
+            perror("config eventfd write failed");
+    }
+    return generation;
+}
+
+unsigned current_config_generation()
+{
+    return config_generation;
+}
+
+// Worker eventfds written after every publish, so workers blocked in
+// epoll_wait pick up the new configuration without waiting for traffic
+void watch_config(int wakeup_fd)
+{
+    pthread_mutex_lock(&config_lock);
+    config_watchers.push_back(wakeup_fd);
+    pthread_mutex_unlock(&config_lock);
+}
+
+void unwatch_config(int wakeup_fd)
+{
+    pthread_mutex_lock(&config_lock);
+    config_watchers.erase(std::remove(config_watchers.begin(), config_watchers.end(), wakeup_fd),
+                          config_watchers.end());
+    pthread_mutex_unlock(&config_lock);
+}
+
+static void reload_signal_handler(int sig)
+{
+    (void)sig;
+    reload_requested = 1;
+}
+
+// SIGHUP interrupts epoll_wait (or waitpid in the pre-fork master); the
+// loop then sees the request. No SA_RESTART, so the wait does return.
+void install_reload_handler()
+{
+    struct sigaction sa;
+    std::memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = reload_signal_handler;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGHUP, &sa, NULL);
+}
+
+// True once per SIGHUP, for the one thread that gets to reload
+bool take_reload_request()
+{
+    return reload_requested && __sync_bool_compare_and_swap(&reload_requested, 1, 0);
+}
+
+// Parse the configuration file again and publish it. A file that does not
+// parse leaves the running configuration in place. Directives of the
+// global section (workers, backend, timeouts) only take effect on restart.
+bool reload_config()
+{
+    GlobalConfig global;
+    ConfigSnapshot *config = new ConfigSnapshot();
+    if (!initialize_server_config(*config, global))
+    {
+        std::cerr << "Reload failed, keeping the current configuration" << std::endl;
+        delete config;
+        return false;
+    }
+    unsigned generation = publish_config(config);
+    std::cout << "Configuration reloaded (generation " << generation << ")" << std::endl;
+    return true;
+}
@@ -0,0 +1,333 @@
+#include "server.hpp"
+
+#ifdef WEBSERV_COROUTINES
+#include <coroutine>
+#include <exception>
+
+// Connections as C++20 coroutines (make COROUTINES=1). A connection's whole
+// lifecycle reads top to bottom in serve_connection(): read and parse a
+// request, answer it, wait for its CGI script or I/O job, send the
+// response, go again. Every wait is a co_await on one thing: socket
+// readiness, CGI output, an I/O job, or the next turn of the run queue.
+// The reactor resumes a coroutine only for what it waits on, or when the
+// deadline of the connection's phase passes, so a suspended connection
+// holds no thread, only its coroutine frame. The parsing, response and CGI
+// code is shared with the callback build, which drives the same steps from
+// run_client(). The io_uring backend keeps driving connections with
+// callbacks.
+
+namespace
+{
+
+struct ConnectionTask
+{
+    struct promise_type
+    {
+        ChunkedClientInfo &client;
+
+        promise_type(Worker &worker, ChunkedClientInfo &client) : client(client) { (void)worker; }
+
+        // The reactor finds the coroutine through the client it serves
+        ConnectionTask get_return_object()
+        {
+            client.task = std::coroutine_handle<promise_type>::from_promise(*this).address();
+            return ConnectionTask();
+        }
+        std::suspend_never initial_suspend() noexcept { return std::suspend_never(); }
+        // Finished frames stay until close_client() destroys them
+        std::suspend_always final_suspend() noexcept { return std::suspend_always(); }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+    };
+};
+
+// Register the socket interest the coroutine waits for, and the deadline
+// of the phase it is in, as flush_client() does in the callback build
+void watch_client(Worker &worker, ChunkedClientInfo &client, uint32_t events)
+{
+    update_client_timer(worker, client);
+    if (worker.global->edge_triggered)
+        events |= EPOLLET;
+    if (events == client.epoll_events)
+        return;
+    struct epoll_event ev;
+    ev.events = events;
+    ev.data.ptr = static_cast<EventHandle *>(&client);
+    if (epoll_ctl(worker.epfd, EPOLL_CTL_MOD, client.fd, &ev) == 0)
+        client.epoll_events = events;
+}
+
+// Suspend on one thing, see wake_connection_task(), with the deadline of
+// the connection's phase armed, see expire_connection_task()
+struct Suspend
+{
+    Worker &worker;
+    ChunkedClientInfo &client;
+    TaskWait what;
+    uint32_t events;
+
+    Suspend(Worker &worker, ChunkedClientInfo &client, TaskWait what, uint32_t events)
+        : worker(worker), client(client), what(what), events(events) {}
+    bool await_ready() const noexcept { return false; }
+    void await_suspend(std::coroutine_handle<>)
+    {
+        watch_client(worker, client, events);
+        client.task_wait = what;
+        client.task_events = events;
+        client.task_expired = false;
+    }
+    // False when the deadline passed first
+    bool resumed()
+    {
+        client.task_wait = TASK_RUNNING;
+        return !client.task_expired;
+    }
+};
+
+// Socket readiness. Resumes with the events epoll reported, or 0 when the
+// deadline passed first.
+struct SocketReady : Suspend
+{
+    SocketReady(Worker &worker, ChunkedClientInfo &client, uint32_t events)
+        : Suspend(worker, client, TASK_SOCKET, events) {}
+    uint32_t await_resume() { return resumed() ? client.task_events : 0; }
+};
+
+// The CGI script wrote or closed its output. False when it ran past the
+// deadline.
+struct CgiOutput : Suspend
+{
+    CgiOutput(Worker &worker, ChunkedClientInfo &client) : Suspend(worker, client, TASK_CGI, 0) {}
+    bool await_resume() { return resumed(); }
+};
+
+// An I/O thread prepared the response, and on_io_done() moved it into the
+// connection. False when the deadline passed first.
+struct IoJobDone : Suspend
+{
+    IoJobDone(Worker &worker, ChunkedClientInfo &client) : Suspend(worker, client, TASK_IO_JOB, 0) {}
+    bool await_resume() { return resumed(); }
+};
+
+// Yield after spending a read or send budget: the connection continues on
+// its next turn of the run queue
+struct NextTurn
+{
+    Worker &worker;
+    ChunkedClientInfo &client;
+
+    NextTurn(Worker &worker, ChunkedClientInfo &client) : worker(worker), client(client) {}
+    bool await_ready() const noexcept { return false; }
+    void await_suspend(std::coroutine_handle<>)
+    {
+        schedule_client(worker, client);
+        update_client_timer(worker, client);
+        client.task_wait = TASK_TURN;
+    }
+    void await_resume()
+    {
+        client.task_wait = TASK_RUNNING;
+        client.wakeup_bytes = 0;
+    }
+};
+
+void close_timed_out(Worker &worker, ChunkedClientInfo &client)
+{
+    std::cout << "Client " << client.fd << " timed out" << std::endl;
+    worker.closing.push_back(ClientRef(client.fd, client.generation));
+}
+
+ConnectionTask serve_connection(Worker &worker, ChunkedClientInfo &client)
+{
+    int fd = client.fd;
+    int batch = 0;
+    while (true)
+    {
+        // Read the request head, then its body. A request the client
+        // pipelined is buffered already and is parsed before the socket is
+        // read again.
+        bool need_input = client.partial_data.empty();
+        while (client.is_active && (client.upload_state == 0 || client.upload_state == 1))
+        {
+            if (need_input)
+            {
+                uint32_t events = co_await SocketReady(worker, client, EPOLLIN);
+                if (events == 0)
+                {
+                    close_timed_out(worker, client);
+                    co_return;
+                }
+                if (events & EPOLLERR)
+                {
+                    fail_client(client);
+                    break;
+                }
+                client.wakeup_bytes = 0;
+            }
+            if (!begin_client_turn(worker, client))
+                break;
+            if (client.server_index >= client.config->global_obj.size())
+            {
+                client.is_active = false;
+                break;
+            }
+            if (client.upload_state == 0)
+            {
+                if (read_headers_chunked(fd, client, client.config->global_obj, client.config->hostport_to_indexes,
+                                         client.server_index))
+                    accept_request_head(fd, client);
+            }
+            else if (read_body_chunk(fd, client))
+                respond(fd, client);
+            need_input = client.socket_drained;
+            if (client.wakeup_bytes >= worker.global->read_budget)
+                co_await NextTurn(worker, client);
+        }
+
+        // GET and DELETE responses are prepared by an I/O thread meanwhile
+        if (client.is_active && client.upload_state == 5 && !client.io_pending)
+            dispatch_response(worker, client);
+        if (client.io_pending)
+        {
+            if (!co_await IoJobDone(worker, client))
+            {
+                close_timed_out(worker, client);
+                co_return;
+            }
+            finish_request(client);
+        }
+
+        // A CGI script answers once it closes its output
+        if (client.is_active && client.upload_state == 3 && client.cgi_pipe.fd != -1)
+        {
+            while (true)
+            {
+                if (!co_await CgiOutput(worker, client))
+                {
+                    // The client still gets its 504
+                    cgi_timed_out(client, fd);
+                    break;
+                }
+                if (read_cgi_output(client))
+                {
+                    finish_cgi_request(client, fd);
+                    break;
+                }
+            }
+        }
+
+        // Answer the requests pipelined behind this one first, so the
+        // responses leave in one write batch
+        if (++batch < PIPELINE_BATCH && start_pipelined_request(worker, client))
+            continue;
+        batch = 0;
+
+        while (!client.output.empty() || client.transfer.active())
+        {
+            bool budget_spent;
+            if (!send_client_output(worker, client, budget_spent))
+                break;
+            if (client.output.empty() && !client.transfer.active())
+                break;
+            if (budget_spent)
+            {
+                co_await NextTurn(worker, client);
+                continue;
+            }
+            uint32_t events = co_await SocketReady(worker, client, EPOLLOUT);
+            if (events == 0)
+            {
+                close_timed_out(worker, client);
+                co_return;
+            }
+            if (events & EPOLLERR)
+            {
+                fail_client(client);
+                break;
+            }
+        }
+
+        if (!client.is_active || client.upload_state != 4 || !start_next_request(worker, client))
+            break;
+    }
+    worker.closing.push_back(ClientRef(client.fd, client.generation));
+}
+
+} // namespace
+
+// Start the coroutine of a connection just registered with epoll. It runs
+// until it waits for the first request.
+bool start_connection_task(Worker &worker, ChunkedClientInfo &client)
+{
+    serve_connection(worker, client);
+    return true;
+}
+
+// Resume the connection's coroutine if it is suspended on what happened.
+// Socket events resume a socket wait only when they answer it, an error or
+// hangup always does. Returns false when the coroutine did not wait for it.
+bool wake_connection_task(ChunkedClientInfo &client, TaskWait what, uint32_t events)
+{
+    if (!client.task || client.task_wait != what)
+        return false;
+    if (what == TASK_SOCKET)
+    {
+        if (!(events & (client.task_events | EPOLLERR | EPOLLHUP)))
+            return false;
+        client.task_events = events;
+    }
+    std::coroutine_handle<>::from_address(client.task).resume();
+    return true;
+}
+
+// The deadline of the connection's phase passed: resume its coroutine to
+// deal with it, if it waits on the socket, its CGI script or an I/O job.
+// Returns false when it does not.
+bool expire_connection_task(ChunkedClientInfo &client)
+{
+    if (!client.task || client.task_wait == TASK_RUNNING || client.task_wait == TASK_TURN)
+        return false;
+    client.task_expired = true;
+    std::coroutine_handle<>::from_address(client.task).resume();
+    return true;
+}
+
+void destroy_connection_task(ChunkedClientInfo &client)
+{
+    if (!client.task)
+        return;
+    std::coroutine_handle<>::from_address(client.task).destroy();
+    client.task = NULL;
+}
+
+#else
+
+// Built without coroutines: connections are driven by callbacks
+
+bool start_connection_task(Worker &worker, ChunkedClientInfo &client)
+{
+    (void)worker;
+    (void)client;
+    return false;
+}
+
+bool wake_connection_task(ChunkedClientInfo &client, TaskWait what, uint32_t events)
+{
+    (void)client;
+    (void)what;
+    (void)events;
+    return false;
+}
+
+bool expire_connection_task(ChunkedClientInfo &client)
+{
+    (void)client;
+    return false;
+}
+
+void destroy_connection_task(ChunkedClientInfo &client)
+{
+    (void)client;
+}
+
+#endif
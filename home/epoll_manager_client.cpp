@@ -1,70 +1,207 @@
 #include "server.hpp"
+#include <algorithm>
+#include <netinet/tcp.h>
 
 // Accept new client connection
 int accept_new_client(int socket_fd)
 {
-    while (true)
-    {
-        int new_socket = accept_client(socket_fd);
-        if (new_socket < 0)
-            return -1;
+    return accept_client(socket_fd);
+}
 
-        make_nonblocking(new_socket);
-        return new_socket;
+// Fill a connection object fresh from the pool. config is a reference the
+// connection takes over.
+static void init_client(Worker &worker, ChunkedClientInfo &client, int client_fd, ConfigSnapshot *config,
+                        size_t server_index)
+{
+    client.last_active = worker.now;
+    client.config = config;
+    client.server_index = server_index;  // Store server association
+    client.listen_index = server_index;
+    client.max_requests = worker.global->keepalive_timeout > 0 ? worker.global->keepalive_requests : 1;
+    client.fd = client_fd;
+    client.on_event = on_client_event;
+    client.cgi_pipe.client = &client;
+    client.cgi_pipe.on_event = on_cgi_pipe_event;
+    client.cgi_stdin.client = &client;
+    client.cgi_stdin.on_event = on_cgi_stdin_event;
+    client.timer.fd = client_fd;
+}
+
+// First bytes (or a hangup) on a pending connection: open its full
+// record, hand epoll and the timer over to it, and serve the event. The
+// header deadline still counts from accept.
+static void on_pending_event(Worker &worker, EventHandle *handle, uint32_t events)
+{
+    PendingClient &pending = *static_cast<PendingClient *>(handle);
+    int fd = pending.fd;
+    ConfigSnapshot *config = pending.config;
+    size_t listen_index = pending.listen_index;
+    time_t accepted = pending.accepted;
+    worker.timers.cancel(pending.timer);
+
+    ChunkedClientInfo &client = *worker.clients.promote(fd);
+    init_client(worker, client, fd, config, listen_index);
+    client.timer_phase = 0;
+    client.phase_started = accepted;
+
+    struct epoll_event ev;
+    ev.events = worker.global->edge_triggered ? (EPOLLIN | EPOLLET) : EPOLLIN;
+    ev.data.ptr = static_cast<EventHandle *>(&client);
+    if (epoll_ctl(worker.epfd, EPOLL_CTL_MOD, fd, &ev) == -1)
+    {
+        perror("epoll_ctl: activate client socket");
+        worker.closing.push_back(ClientRef(fd, client.generation));
+        return;
     }
+    client.epoll_events = ev.events;
+    update_client_timer(worker, client);
+    // In the C++20 build the connection runs as a coroutine from here on
+    start_connection_task(worker, client);
+    on_client_event(worker, &client, events);
 }
 
-// Add client to epoll with server index
-bool add_client_to_epoll(int epfd, int client_fd, std::map<int, ChunkedClientInfo> &clients,
-                         const Request &global_obj, size_t server_index)
+// Add client to epoll with server index. With epoll the connection only
+// gets a PendingClient until its first bytes arrive; the io_uring backend
+// receives into its provided buffers right away and opens the full record.
+bool add_client_to_epoll(Worker &worker, int client_fd, const Request &global_obj, size_t server_index)
 {
+    if (worker.ring)
+    {
+        // The pooled object comes back reset and keeps its address while in use
+        ChunkedClientInfo *slot = worker.clients.open(client_fd);
+        if (!slot)
+        {
+            std::cerr << "Client fd " << client_fd << " is already in use" << std::endl;
+            close(client_fd);
+            return false;
+        }
+        retain_config(worker.config);
+        init_client(worker, *slot, client_fd, worker.config, server_index);
+        // Completions stand in for readiness: start the first receive
+        slot->ring.enabled = true;
+        update_client_timer(worker, *slot);
+        uring_arm_client(worker, *slot);
+        return true;
+    }
+
+    PendingClient *pending = worker.clients.open_pending(client_fd);
+    if (!pending)
+    {
+        std::cerr << "Client fd " << client_fd << " is already in use" << std::endl;
+        close(client_fd);
+        return false;
+    }
+    pending->fd = client_fd;
+    pending->on_event = on_pending_event;
+    pending->listen_index = server_index;
+    pending->accepted = worker.now;
+    pending->config = worker.config;
+    retain_config(pending->config);
+    pending->timer.fd = client_fd;
+
     struct epoll_event client_event;
-    client_event.events = EPOLLIN;
-    client_event.data.fd = client_fd;
+    client_event.events = worker.global->edge_triggered ? (EPOLLIN | EPOLLET) : EPOLLIN;
+    client_event.data.ptr = static_cast<EventHandle *>(pending);
 
-    if (epoll_ctl(epfd, EPOLL_CTL_ADD, client_fd, &client_event) == -1)
+    if (epoll_ctl(worker.epfd, EPOLL_CTL_ADD, client_fd, &client_event) == -1)
     {
         perror("epoll_ctl: add client socket");
+        release_config(pending->config);
+        worker.clients.release(client_fd);
         close(client_fd);
         return false;
     }
+    worker.timers.schedule(pending->timer, pending->accepted + HEADER_TIMEOUT);
 
-    ChunkedClientInfo new_client;
-    new_client.is_active = true;
-    new_client.last_active = time(NULL);
-    new_client.upload_state = 0;
-    new_client.content_length = -1;
-    new_client.bytes_read = 0;
-    new_client.headers_complete = false;
-    new_client.request_obj = global_obj;
-    new_client.server_index = server_index;  // Store server association
-
-    clients[client_fd] = new_client;
     std::cout << "New client " << client_fd << " connected to server " << server_index 
               << " (port " << global_obj.server.port << ")" << std::endl;
     return true;
 }
 
-// Handle new connections with server index
-void handle_new_connections(int socket_fd, int epfd, std::map<int, ChunkedClientInfo> &clients,
-                            const Request &global_obj, size_t server_index)
+// TcpExt ListenOverflows from /proc/net/netstat: connections the kernel
+// dropped, on any listener, because the accept queue was full
+static long read_listen_overflows()
+{
+    std::ifstream file("/proc/net/netstat");
+    std::string names;
+    std::string values;
+    while (std::getline(file, names) && std::getline(file, values))
+    {
+        if (names.compare(0, 7, "TcpExt:") != 0)
+            continue;
+        std::istringstream name_stream(names);
+        std::istringstream value_stream(values);
+        std::string name;
+        std::string value;
+        while (name_stream >> name && value_stream >> value)
+        {
+            if (name == "ListenOverflows")
+                return atol(value.c_str());
+        }
+    }
+    return -1;
+}
+
+// Look at the accept queue through TCP_INFO (for a listener, tcpi_unacked
+// is the queue length and tcpi_sacked the backlog) and warn, at most every
+// ACCEPT_REPORT_INTERVAL, while it is full and the kernel drops connections.
+static void check_accept_queue(Worker &worker, ServerInfo &server)
+{
+    AcceptStats &stats = server.stats;
+
+    struct tcp_info info;
+    socklen_t len = sizeof(info);
+    if (getsockopt(server.socket_fd, IPPROTO_TCP, TCP_INFO, &info, &len) == -1)
+        return;
+    stats.queue_peak = std::max(stats.queue_peak, static_cast<unsigned>(info.tcpi_unacked));
+    if (info.tcpi_unacked < info.tcpi_sacked)
+        return;
+
+    stats.queue_full++;
+    if (worker.now - stats.last_report < ACCEPT_REPORT_INTERVAL)
+        return;
+    stats.last_report = worker.now;
+    const ServerConfig &config = worker.config->global_obj[server.config_index].server;
+    std::cerr << "[WARN] Worker " << worker.id << ": accept queue of " << config.host << ":" << config.port
+              << " is full (" << info.tcpi_unacked << "/" << info.tcpi_sacked << "), seen "
+              << stats.queue_full << " times, " << read_listen_overflows()
+              << " overflows system-wide; consider a larger listen backlog" << std::endl;
+}
+
+// Accept up to ACCEPT_BATCH connections from one listener, so a burst on
+// one port does not starve the connections already open. Returns true
+// when the batch was used up and connections may still be waiting.
+bool handle_new_connections(Worker &worker, ServerInfo &server)
 {
-    while (true)
+    const Request &global_obj = worker.config->global_obj[server.config_index];
+    // Only sample the queue, before draining it, while the listener is busy
+    if (server.stats.busy)
+        check_accept_queue(worker, server);
+
+    int accepted = 0;
+    while (accepted < ACCEPT_BATCH)
     {
-        int new_socket = accept_new_client(socket_fd);
+        int new_socket = accept_new_client(server.socket_fd);
         if (new_socket < 0)
             break;
 
-        if (!add_client_to_epoll(epfd, new_socket, clients, global_obj, server_index))
-        {
+        accepted++;
+        if (!add_client_to_epoll(worker, new_socket, global_obj, server.config_index))
             break;
-        }
     }
+    server.stats.accepted += accepted;
+    if (accepted == ACCEPT_BATCH)
+        server.stats.capped++;
+    server.stats.busy = (accepted >= std::min(ACCEPT_BATCH, server.backlog));
+    return accepted == ACCEPT_BATCH;
 }
 
 // Clean up client resources
 void cleanup_client(int fd, ChunkedClientInfo &client)
 {
+    client.transfer.close();
+    // A script still running for a client that is gone is stopped
+    stop_cgi(client);
     if (client.file_stream.is_open())
     {
         client.file_stream.close();
@@ -76,67 +213,80 @@ void cleanup_client(int fd, ChunkedClientInfo &client)
     }
 }
 
-// Check if client should be cleaned up
-bool should_cleanup_client(const ChunkedClientInfo &client)
-{
-    return !client.is_active || (time(NULL) - client.last_active > 60);
-}
-
-// Fixed cleanup function with proper debugging
-void cleanup_inactive_clients(int epfd, std::map<int, ChunkedClientInfo> &clients)
+// Deadline for the phase the client is in. The header deadline counts from
+// accept or from the previous response; body and send deadlines move with
+// every bit of progress.
+void update_client_timer(Worker &worker, ChunkedClientInfo &client)
 {
-    std::vector<int> clients_to_remove; // Collect clients to remove first
-    
-    for (std::map<int, ChunkedClientInfo>::iterator it = clients.begin(); it != clients.end(); ++it)
+    // A finished client that is still here is waiting for its output to drain
+    int phase = client.is_active ? client.upload_state : 2;
+    if (client.timer_phase != phase)
     {
-        int fd = it->first;
-        ChunkedClientInfo &client = it->second;
-
-        if (should_cleanup_client(client))
-        {
-            std::cout << "DEBUG: Marking client " << fd << " for cleanup (server_index: " 
-                      << client.server_index << ", is_active: " << client.is_active << ")" << std::endl;
-            clients_to_remove.push_back(fd);
-        }
+        client.timer_phase = phase;
+        client.phase_started = worker.now;
     }
-    
-    // Now actually remove the clients
-    for (std::vector<int>::iterator it = clients_to_remove.begin(); it != clients_to_remove.end(); ++it)
+
+    time_t expires;
+    switch (phase)
     {
-        int fd = *it;
-        std::map<int, ChunkedClientInfo>::iterator client_it = clients.find(fd);
-        if (client_it != clients.end())
-        {
-            std::cout << "Cleaning up client " << fd << " from server " << client_it->second.server_index << std::endl;
-            cleanup_client(fd, client_it->second);
-            epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL);
-            close(fd);
-            clients.erase(client_it);
-        }
+    case 0:
+        // Between requests the idle keep-alive timeout applies instead
+        if (client.requests > 0 && client.partial_data.empty())
+            expires = client.phase_started + worker.global->keepalive_timeout;
+        else
+            expires = client.phase_started + HEADER_TIMEOUT;
+        break;
+    case 1:
+        expires = std::max(client.last_active, client.phase_started) + BODY_TIMEOUT;
+        break;
+    case 3:
+        expires = client.phase_started + CGI_TIMEOUT;
+        break;
+    default:
+        expires = std::max(client.last_active, client.phase_started) + SEND_TIMEOUT;
+        break;
     }
+
+    if (!client.timer.linked || client.timer.expires != expires)
+        worker.timers.schedule(client.timer, expires);
 }
 
-// Set up epoll (this function is no longer needed in the multi-server setup)
-// But keeping it for backward compatibility if needed elsewhere
-int setup_epoll(int socket_fd)
+// Remove a client from epoll, its timer and the table, and close it.
+// Stale references (the fd was closed and reused since) are ignored.
+void close_client(Worker &worker, const ClientRef &ref)
 {
-    int epfd = epoll_create1(EPOLL_CLOEXEC);
-    if (epfd == -1)
+    PendingClient *pending = worker.clients.find_pending(ref);
+    if (pending)
     {
-        perror("epoll_create1 failed");
-        return -1;
+        // Nothing was received, so there is nothing else to clean up
+        std::cout << "Cleaning up client " << ref.fd << " from server " << pending->listen_index << std::endl;
+        worker.timers.cancel(pending->timer);
+        epoll_ctl(worker.epfd, EPOLL_CTL_DEL, ref.fd, NULL);
+        close(ref.fd);
+        release_config(pending->config);
+        worker.clients.release(ref.fd);
+        return;
     }
+    ChunkedClientInfo *client = worker.clients.find(ref);
+    if (!client)
+        return;
 
-    struct epoll_event ev;
-    ev.events = EPOLLIN;
-    ev.data.fd = socket_fd;
-
-    if (epoll_ctl(epfd, EPOLL_CTL_ADD, socket_fd, &ev) == -1)
+    std::cout << "Cleaning up client " << ref.fd << " from server " << client->server_index << std::endl;
+    worker.timers.cancel(client->timer);
+    destroy_connection_task(*client);
+    if (worker.ring)
     {
-        perror("epoll_ctl: add server socket");
-        close(epfd);
-        return -1;
+        // The ring closes the fds once no request in flight uses them
+        uring_close_client(worker, *client);
+        cleanup_client(ref.fd, *client);
     }
-
-    return epfd;
-}
\ No newline at end of file
+    else
+    {
+        cleanup_client(ref.fd, *client);
+        epoll_ctl(worker.epfd, EPOLL_CTL_DEL, ref.fd, NULL);
+        close(ref.fd);
+    }
+    release_config(client->config);
+    client->config = NULL;
+    worker.clients.release(ref.fd);
+}
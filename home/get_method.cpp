@@ -169,12 +169,13 @@ void handle_directory_request(const std::string &path, const std::string &uri, i
     }
 
     std::string html = generate_directory_listing(path, uri);
-    std::string header = "HTTP/1.1 200 OK\r\nContent-Type: text/html\r\n\r\n";
-    std::string full_response = header + html;
+    std::ostringstream header;
+    header << "HTTP/1.1 200 OK\r\nContent-Type: text/html\r\n";
+    header << "Content-Length: " << html.size() << "\r\n";
+    header << connection_header(fd) << "\r\n";
+    std::string full_response = header.str() + html;
 
-    // Add error checking for write operation
-    ssize_t bytes_written = write(fd, full_response.c_str(), full_response.length());
-    if (bytes_written == -1)
+    if (!queue_send(fd, full_response.c_str(), full_response.length()))
     {
         std::cerr << "Error writing response to socket" << std::endl;
     }
@@ -193,12 +194,13 @@ std::string remove_first_slash(const std::string &path)
 }
 
 bool initialize_and_serve_direct_path(Request &obj, const std::string &path,
-                                      const std::string &type, const std::string &uri, int &fd)
+                                      const std::string &type, const std::string &uri, int &fd,
+                                      const std::string &range)
 {
     if (is_file(path))
     {
         std::string header = "HTTP/1.1 200 OK\r\nContent-Type: " + type + "\r\n";
-        response(path, fd, header);
+        response_plus(path, fd, header, range);
         return true;
     }
 
@@ -216,10 +218,10 @@ void serve_not_found(int &fd)
     response("error_page/404.html", fd, header);
 }
 
-void parsing_Get(std::map<std::string, std::string> head, std::string path,
+void parsing_Get(const std::string &range, std::string path,
                  int &fd, std::string type, std::string uri, Request &obj)
 {
-    if (initialize_and_serve_direct_path(obj, path, type, uri, fd))
+    if (initialize_and_serve_direct_path(obj, path, type, uri, fd, range))
         return;
 
     serve_not_found(fd);
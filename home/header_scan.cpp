@@ -0,0 +1,208 @@
+#include "server.hpp"
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SCAN_X86
+#endif
+
+// Delimiter scans of the request parser. Field values (cookies, tokens)
+// and targets are the long runs of a request head; these find where they
+// end 16 or 32 bytes at a time. The target's path is scanned the same way
+// for the bytes its canonicalization has to look at. The AVX2 kernels are
+// compiled with a function target attribute, so the build needs no
+// -mavx2, and are only picked when the CPU has AVX2. Elsewhere SSE2,
+// baseline on x86-64, or plain loops.
+
+static size_t line_end_scalar(const char *data, size_t size)
+{
+    for (size_t i = 0; i < size; ++i)
+    {
+        if (data[i] == '\r' || data[i] == '\n')
+            return i;
+    }
+    return size;
+}
+
+static size_t target_end_scalar(const char *data, size_t size)
+{
+    for (size_t i = 0; i < size; ++i)
+    {
+        unsigned char c = data[i];
+        if (c <= ' ' || c == 0x7f)
+            return i;
+    }
+    return size;
+}
+
+static size_t path_special_scalar(const char *data, size_t size)
+{
+    for (size_t i = 0; i < size; ++i)
+    {
+        if (data[i] == '%' || data[i] == '+' || data[i] == '/')
+            return i;
+    }
+    return size;
+}
+
+#if defined(SCAN_X86) && defined(__SSE2__)
+#define SCAN_SSE2
+
+static size_t line_end_sse2(const char *data, size_t size)
+{
+    const __m128i cr = _mm_set1_epi8('\r');
+    const __m128i lf = _mm_set1_epi8('\n');
+    size_t i = 0;
+    for (; i + 16 <= size; i += 16)
+    {
+        __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i));
+        int mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(chunk, cr), _mm_cmpeq_epi8(chunk, lf)));
+        if (mask)
+            return i + __builtin_ctz(mask);
+    }
+    return i + line_end_scalar(data + i, size - i);
+}
+
+// A byte is at most ' ' exactly when min(byte, ' ') is the byte itself
+static size_t target_end_sse2(const char *data, size_t size)
+{
+    const __m128i space = _mm_set1_epi8(' ');
+    const __m128i del = _mm_set1_epi8(0x7f);
+    size_t i = 0;
+    for (; i + 16 <= size; i += 16)
+    {
+        __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i));
+        __m128i control = _mm_cmpeq_epi8(_mm_min_epu8(chunk, space), chunk);
+        int mask = _mm_movemask_epi8(_mm_or_si128(control, _mm_cmpeq_epi8(chunk, del)));
+        if (mask)
+            return i + __builtin_ctz(mask);
+    }
+    return i + target_end_scalar(data + i, size - i);
+}
+
+static size_t path_special_sse2(const char *data, size_t size)
+{
+    const __m128i percent = _mm_set1_epi8('%');
+    const __m128i plus = _mm_set1_epi8('+');
+    const __m128i slash = _mm_set1_epi8('/');
+    size_t i = 0;
+    for (; i + 16 <= size; i += 16)
+    {
+        __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i));
+        __m128i found = _mm_or_si128(_mm_cmpeq_epi8(chunk, percent), _mm_cmpeq_epi8(chunk, plus));
+        int mask = _mm_movemask_epi8(_mm_or_si128(found, _mm_cmpeq_epi8(chunk, slash)));
+        if (mask)
+            return i + __builtin_ctz(mask);
+    }
+    return i + path_special_scalar(data + i, size - i);
+}
+#endif
+
+#ifdef SCAN_X86
+#define SCAN_AVX2
+
+__attribute__((target("avx2"))) static size_t line_end_avx2(const char *data, size_t size)
+{
+    const __m256i cr = _mm256_set1_epi8('\r');
+    const __m256i lf = _mm256_set1_epi8('\n');
+    size_t i = 0;
+    for (; i + 32 <= size; i += 32)
+    {
+        __m256i chunk = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(data + i));
+        unsigned mask = _mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(chunk, cr),
+                                                             _mm256_cmpeq_epi8(chunk, lf)));
+        if (mask)
+            return i + __builtin_ctz(mask);
+    }
+    return i + line_end_scalar(data + i, size - i);
+}
+
+__attribute__((target("avx2"))) static size_t target_end_avx2(const char *data, size_t size)
+{
+    const __m256i space = _mm256_set1_epi8(' ');
+    const __m256i del = _mm256_set1_epi8(0x7f);
+    size_t i = 0;
+    for (; i + 32 <= size; i += 32)
+    {
+        __m256i chunk = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(data + i));
+        __m256i control = _mm256_cmpeq_epi8(_mm256_min_epu8(chunk, space), chunk);
+        unsigned mask = _mm256_movemask_epi8(_mm256_or_si256(control, _mm256_cmpeq_epi8(chunk, del)));
+        if (mask)
+            return i + __builtin_ctz(mask);
+    }
+    return i + target_end_scalar(data + i, size - i);
+}
+
+__attribute__((target("avx2"))) static size_t path_special_avx2(const char *data, size_t size)
+{
+    const __m256i percent = _mm256_set1_epi8('%');
+    const __m256i plus = _mm256_set1_epi8('+');
+    const __m256i slash = _mm256_set1_epi8('/');
+    size_t i = 0;
+    for (; i + 32 <= size; i += 32)
+    {
+        __m256i chunk = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(data + i));
+        __m256i found = _mm256_or_si256(_mm256_cmpeq_epi8(chunk, percent), _mm256_cmpeq_epi8(chunk, plus));
+        unsigned mask = _mm256_movemask_epi8(_mm256_or_si256(found, _mm256_cmpeq_epi8(chunk, slash)));
+        if (mask)
+            return i + __builtin_ctz(mask);
+    }
+    return i + path_special_scalar(data + i, size - i);
+}
+#endif
+
+typedef size_t (*ScanFunction)(const char *data, size_t size);
+
+struct ScanKernels
+{
+    const char *name;
+    ScanFunction line_end;
+    ScanFunction target_end;
+    ScanFunction path_special;
+};
+
+// Picked once, during static initialization, before any thread runs
+static ScanKernels pick_scan_kernels()
+{
+    ScanKernels kernels = {"scalar", line_end_scalar, target_end_scalar, path_special_scalar};
+#ifdef SCAN_X86
+    __builtin_cpu_init();
+#endif
+#ifdef SCAN_AVX2
+    if (__builtin_cpu_supports("avx2"))
+    {
+        ScanKernels avx2 = {"AVX2", line_end_avx2, target_end_avx2, path_special_avx2};
+        return avx2;
+    }
+#endif
+#ifdef SCAN_SSE2
+    ScanKernels sse2 = {"SSE2", line_end_sse2, target_end_sse2, path_special_sse2};
+    kernels = sse2;
+#endif
+    return kernels;
+}
+
+static ScanKernels scan_kernels = pick_scan_kernels();
+
+// Offset of the first CR or LF in data[0, size), size when there is none
+size_t scan_line_end(const char *data, size_t size)
+{
+    return scan_kernels.line_end(data, size);
+}
+
+// Offset of the first space, control byte or DEL, which ends a request
+// target; size when there is none
+size_t scan_target_end(const char *data, size_t size)
+{
+    return scan_kernels.target_end(data, size);
+}
+
+// Offset of the first '%', '+' or '/', the bytes URL decoding and path
+// canonicalization act on; size when there is none
+size_t scan_path_special(const char *data, size_t size)
+{
+    return scan_kernels.path_special(data, size);
+}
+
+const char *scan_kernel_name()
+{
+    return scan_kernels.name;
+}
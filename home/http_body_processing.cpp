@@ -1,5 +1,55 @@
 #include "server.hpp"
 
+bool UploadFile::open(const char *name, const ClientRef &client)
+{
+    close();
+    fd = ::open(name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    offset = 0;
+    owner = client;
+    return fd != -1;
+}
+
+void UploadFile::write(const char *data, size_t size)
+{
+    if (fd == -1 || size == 0)
+        return;
+    Worker *worker = running_worker();
+    if (worker && worker->ring)
+    {
+        // The ring writes from its own copy; the request waits for it
+        uring_write_upload(*worker, *this, data, size);
+        offset += size;
+        return;
+    }
+    size_t done = 0;
+    while (done < size)
+    {
+        ssize_t n = pwrite(fd, data + done, size - done, offset + done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+        {
+            perror("Upload write failed");
+            break;
+        }
+        done += n;
+    }
+    offset += done;
+}
+
+// On the ring the fd closes once the writes still using it completed
+void UploadFile::close()
+{
+    if (fd == -1)
+        return;
+    Worker *worker = running_worker();
+    if (worker && worker->ring)
+        uring_close_upload(*worker, fd);
+    else
+        ::close(fd);
+    fd = -1;
+}
+
 bool process_plain_text_request(ChunkedClientInfo &client)
 {
     std::cout << "Processing plain text request" << std::endl;
@@ -30,18 +80,18 @@ bool process_post_request(ChunkedClientInfo &client)
         return false;
     }
 
-    std::map<std::string, std::string>::iterator ct_it = client.parsed_headers.find("Content-Type");
-    if (ct_it == client.parsed_headers.end())
+    StrView content_type = request_header(client, HEADER_CONTENT_TYPE);
+    if (content_type.empty())
     {
         std::cerr << "POST request without Content-Type" << std::endl;
         return false;
     }
 
-    if (ct_it->second.find("multipart/form-data") != std::string::npos)
+    if (content_type.contains_nocase("multipart/form-data"))
     {
-        return process_multipart_request(client, ct_it->second);
+        return process_multipart_request(client, content_type.str());
     }
-    else if (ct_it->second.find("application/x-www-form-urlencoded") != std::string::npos)
+    else if (content_type.contains_nocase("application/x-www-form-urlencoded"))
     {
         if (process_urlencoded_request(client))
         {
@@ -50,11 +100,11 @@ bool process_post_request(ChunkedClientInfo &client)
         }
         return false;
     }
-    else if (ct_it->second.find("plain/text") != std::string::npos)
+    else if (content_type.contains_nocase("plain/text"))
     {
         if (process_plain_text_request(client))
         {
-            client.request_obj.mthod = "GET";
+            client.request_obj.method = METHOD_GET;
             client.request_obj.path = client.filename;
             client.upload_state = 2;
             return true;
@@ -63,7 +113,7 @@ bool process_post_request(ChunkedClientInfo &client)
     }
     else
     {
-        std::cerr << "Unsupported Content-Type for POST: " << ct_it->second << std::endl;
+        std::cerr << "Unsupported Content-Type for POST: " << content_type.str() << std::endl;
         return false;
     }
 }
@@ -97,7 +147,7 @@ bool open_file_for_writing(ChunkedClientInfo &client, const std::string &filenam
     }
     else
         client.filename = "upload/" + filename;
-    client.file_stream.open(client.filename.c_str(), std::ios::binary);
+    client.file_stream.open(client.filename.c_str(), ClientRef(client.fd, client.generation));
     if (!client.file_stream.is_open())
     {
         std::cerr << "Failed to open file: " << client.filename << std::endl;
@@ -263,13 +313,13 @@ void show_upload_progress(const ChunkedClientInfo &client)
 }
 
 // Get MIME type from file extension
-std::string getmine_type(std::string line_path, std::map<std::string, std::string> mime)
+std::string getmine_type(const std::string &line_path, const std::map<std::string, std::string> &mime)
 {
     std::string::size_type pos = line_path.rfind(".");
     if (pos != std::string::npos)
     {
         std::string type = line_path.substr(pos);
-        std::map<std::string, std::string>::iterator it = mime.find(type);
+        std::map<std::string, std::string>::const_iterator it = mime.find(type);
         if (it != mime.end())
         {
             return it->second;
@@ -278,9 +328,24 @@ std::string getmine_type(std::string line_path, std::map<std::string, std::strin
     return "application/octet-stream";
 }
 
-// Send HTTP response based on method
+// Send HTTP response based on the outcome of the head, then on the method
 void send_response(int fd, ChunkedClientInfo &client)
 {
+    switch (client.request_obj.outcome)
+    {
+    case OUTCOME_REDIRECT:
+        queue_send(fd, client.request_obj.response_red.c_str(), client.request_obj.response_red.size());
+        return;
+    case OUTCOME_METHOD_NOT_ALLOWED:
+        sendErrorResponse(fd, 405, "Method Not Allowed", client.request_obj.server.error_pages[405]);
+        return;
+    case OUTCOME_TOO_LARGE:
+        std::cerr << "Content-Length exceeded or not set" << std::endl;
+        sendErrorResponse(fd, 413, "Request Entity Too Large", client.request_obj.server.error_pages[413]);
+        return;
+    case OUTCOME_NONE:
+        break;
+    }
     if (is_cgi_request(client.request_obj.path))
     {
         std::string index_path = client.request_obj.uri;
@@ -312,19 +377,16 @@ void send_response(int fd, ChunkedClientInfo &client)
         //     return;
         // }
     }
-    if (client.request_obj.mthod == "content_length")
+    switch (client.request_obj.method)
     {
-        std::cerr << "Content-Length exceeded or not set" << std::endl;
-        sendErrorResponse(fd, 413, "Request Entity Too Large", client.request_obj.server.error_pages[413]);
-        return;
-    }
-    else if (client.request_obj.mthod == "GET")
+    case METHOD_GET:
     {
-        std::string type = getmine_type(client.request_obj.path, client.request_obj.mimitype);
-        parsing_Get(client.parsed_headers, client.request_obj.path, fd, type,
+        std::string type = getmine_type(client.request_obj.path, *client.request_obj.mimitype);
+        parsing_Get(request_header(client, HEADER_RANGE).str(), client.request_obj.path, fd, type,
                     client.request_obj.uri, client.request_obj);
+        break;
     }
-    else if (client.request_obj.mthod == "DELETE")
+    case METHOD_DELETE:
     {
         std::string fullPath;
         ssize_t pos = client.request_obj.uri.find_last_of("/");
@@ -403,20 +465,16 @@ void send_response(int fd, ChunkedClientInfo &client)
             sendErrorResponse(fd, 500, "Internal Server Error", client.request_obj.server.error_pages[500]); // Internal error
             return;
         }
-
     }
-    else if (client.request_obj.mthod == "POST")
+    case METHOD_POST:
     {
         std::string header = "HTTP/1.1 200 OK\r\nContent-Type: " +
                              getContentType(client.request_obj.path) + "\r\n";
         response_post(client.request_obj.path, fd, header);
+        break;
     }
-    else if (client.request_obj.mthod == "Redirection")
-    {
-        send(fd, client.request_obj.response_red.c_str(), client.request_obj.response_red.size(), 0);
-    }
-    else
-    {
+    case METHOD_OTHER:
         sendErrorResponse(fd, 405, "Method Not Allowed", client.request_obj.server.error_pages[405]);
+        break;
     }
 }
@@ -1,4 +1,6 @@
 #include "server.hpp"
+#include <algorithm>
+#include <cctype>
 
 std::string get_buffer(std::string buffer, ssize_t bytes_read, ssize_t &size_chunk, ChunkedClientInfo &client)
 {
@@ -60,14 +62,51 @@ bool complete_chunked_data(ChunkedClientInfo &client, std::string data)
     return false;
 }
 
+// Read from a client socket. EAGAIN is not an error here: it only means the
+// socket is drained, which is how an EPOLLET drain loop ends.
+ssize_t read_client(int fd, char *buffer, size_t size, ChunkedClientInfo &client)
+{
+    client.socket_drained = false;
+    if (client.ring.enabled)
+    {
+        // The io_uring backend already received the bytes
+        if (client.ring.size == 0)
+        {
+            client.socket_drained = true;
+            if (client.ring.eof)
+                return 0;
+            errno = client.ring.error ? client.ring.error : EAGAIN;
+            return -1;
+        }
+        size_t n = std::min(size, client.ring.size);
+        std::memcpy(buffer, client.ring.data, n);
+        client.ring.data += n;
+        client.ring.size -= n;
+        client.wakeup_bytes += n;
+        client.socket_drained = (client.ring.size == 0);
+        return n;
+    }
+    ssize_t bytes_read = read(fd, buffer, size);
+    if (bytes_read > 0)
+    {
+        client.wakeup_bytes += bytes_read;
+        // A short read empties the receive queue; EPOLLET reports new data anyway
+        client.socket_drained = (static_cast<size_t>(bytes_read) < size);
+    }
+    else if (bytes_read < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        client.socket_drained = true;
+    return bytes_read;
+}
+
 bool transfer_encoding_chunked(int fd, ChunkedClientInfo &client)
 {
     char buffer[CHUNK_SIZE];
-    ssize_t bytes_read = read(fd, buffer, sizeof(buffer));
+    ssize_t bytes_read = read_client(fd, buffer, sizeof(buffer), client);
 
     if (bytes_read > 0)
     {
         client.last_active = time(NULL);
+        client.body_received += bytes_read;
         // CRITICAL: Use size-based constructor to handle binary data with null bytes
         std::string data(buffer, bytes_read);
 
@@ -103,6 +142,10 @@ bool transfer_encoding_chunked(int fd, ChunkedClientInfo &client)
         client.is_active = false;
         return false;
     }
+    else if (client.socket_drained)
+    {
+        return false;
+    }
     else if (bytes_read < 0)
     {
         perror("Read body chunk failed");
@@ -121,12 +164,24 @@ bool read_body_chunk(int fd, ChunkedClientInfo &client)
     {
         return transfer_encoding_chunked(fd, client);
     }
+    // Never read past the body: what follows is the next pipelined request
+    size_t want = CHUNK_SIZE;
+    if (client.content_length > 0)
+        want = std::min(want, static_cast<size_t>(client.content_length - client.body_received));
+    if (want == 0)
+    {
+        if (client.file_stream.is_open())
+            client.file_stream.close();
+        client.upload_state = 2;
+        return true;
+    }
     char buffer[CHUNK_SIZE];
-    ssize_t bytes_read = read(fd, buffer, sizeof(buffer));
+    ssize_t bytes_read = read_client(fd, buffer, want, client);
 
     if (bytes_read > 0)
     {
         client.last_active = time(NULL);
+        client.body_received += bytes_read;
         std::string data(buffer, bytes_read);
 
         if (client.filename.empty() && !client.boundary.empty())
@@ -136,14 +191,33 @@ bool read_body_chunk(int fd, ChunkedClientInfo &client)
             return (client.upload_state == 2);
         }
 
+        // The closing boundary may straddle two reads: the bytes that could
+        // start it wait for the next read before they go to the file
+        data.insert(0, client.boundary_tail);
+        client.boundary_tail.clear();
         if (check_body_boundary(client, data))
             return true;
+        bool complete = client.content_length > 0 && client.body_received == client.content_length;
+        size_t hold = 0;
+        if (!client.boundary.empty() && !complete)
+            hold = std::min(data.size(), client.boundary.size() + 1);
+        client.boundary_tail.assign(data, data.size() - hold, hold);
 
-        write_body_to_file(client, buffer, bytes_read);
+        if (data.size() > hold)
+            write_body_to_file(client, data.data(), data.size() - hold);
         client.bytes_read += bytes_read;
 
         if (check_upload_complete(client, fd))
             return true;
+        if (complete)
+        {
+            // The last byte is in, whether or not the boundary was found:
+            // no more input will come to finish the body
+            if (client.file_stream.is_open())
+                client.file_stream.close();
+            client.upload_state = 2;
+            return true;
+        }
         show_upload_progress(client);
         return false;
     }
@@ -155,6 +229,10 @@ bool read_body_chunk(int fd, ChunkedClientInfo &client)
         client.is_active = false;
         return false;
     }
+    else if (client.socket_drained)
+    {
+        return false;
+    }
     else if (bytes_read < 0)
     {
         perror("Read body chunk failed");
@@ -167,6 +245,114 @@ bool read_body_chunk(int fd, ChunkedClientInfo &client)
     return false;
 }
 
+// Whether the client asked for the connection to stay open: HTTP/1.1 keeps
+// it unless told to close, HTTP/1.0 only when it asks for keep-alive.
+// The connection's request limit has the last word.
+bool wants_keep_alive(const ChunkedClientInfo &client)
+{
+    if (client.requests + 1 >= client.max_requests)
+        return false;
+
+    StrView connection = request_header(client, HEADER_CONNECTION);
+    if (connection.contains_nocase("close"))
+        return false;
+    if (client.request_obj.version == "HTTP/1.1")
+        return true;
+    return client.request_obj.version == "HTTP/1.0" && connection.contains_nocase("keep-alive");
+}
+
+// Whether the connection can carry another request after the response
+// being written. A body the handler answered without reading, or only read
+// in part, would be parsed as the next request, so that closes instead.
+// Chunked bodies are not tracked to their last byte and always close.
+bool response_keeps_alive(const ChunkedClientInfo &client)
+{
+    if (!client.keep_alive || !client.is_active)
+        return false;
+    if (!client.transfer_encod.empty())
+        return false;
+    if (client.content_length > 0)
+        return client.body_received == client.content_length;
+    return true;
+}
+
+// The response is queued: close after it, or wait for it to drain and then
+// read the next request on the same connection
+void finish_request(ChunkedClientInfo &client)
+{
+    if (response_keeps_alive(client))
+        client.upload_state = 4;
+    else
+        client.is_active = false;
+}
+
+// send_response() routed the request to a CGI script: start it. The
+// client stays in state 3 while the worker collects the script's output.
+static void start_cgi(int fd, ChunkedClientInfo &client)
+{
+    client.last_active = time(NULL);
+    if (client.request_obj.cgj_path.empty())
+    {
+        client.is_active = false;
+        return;
+    }
+    handle_cgi_request(client, fd);
+}
+
+// Answer a complete request. An upload the ring is still writing waits in
+// state 5 until finish_upload(). GET and DELETE stat, open, list and remove
+// files, so they wait in state 5 for the worker to hand them to the I/O
+// pool; CGI scripts answer once they finish; everything else is answered
+// here.
+void respond(int fd, ChunkedClientInfo &client)
+{
+    if (client.file_stream.writing())
+    {
+        client.upload_state = 5;
+        client.io_pending = true;
+        return;
+    }
+    const Request &request = client.request_obj;
+    if (request.outcome == OUTCOME_NONE && (request.method & (METHOD_GET | METHOD_DELETE)) &&
+        !is_cgi_request(request.path))
+    {
+        client.upload_state = 5;
+        return;
+    }
+    send_response(fd, client);
+    if (client.upload_state == 3)
+        start_cgi(fd, client);
+    else
+        finish_request(client);
+}
+
+// The request head is parsed: set up the body, or answer a request that
+// has none right away
+void accept_request_head(int fd, ChunkedClientInfo &client)
+{
+    // An overloaded worker turns new requests away before doing any work for them
+    if (const std::string *busy = overload_response())
+    {
+        queue_send(fd, busy->data(), busy->size());
+        client.keep_alive = false;
+        client.is_active = false;
+        return;
+    }
+    std::cout << "2222========================== : " << client.request_obj.epfd << std::endl;
+    client.keep_alive = wants_keep_alive(client);
+    if (process_request_headers(client))
+    {
+        if (client.upload_state == 2)
+            respond(fd, client);
+    }
+    else
+    {
+        client.keep_alive = false;
+        sendErrorResponse(fd, 400, "Bad Request", client.request_obj.server.error_pages[400]);
+        client.is_active = false;
+    }
+}
+
 // Handle request using state machine
 void handle_request_chunked(int fd, ChunkedClientInfo &client, std::vector<Request> &global_obj,
                             std::map<std::string, std::vector<size_t> > &hostport_to_indexes,
@@ -176,54 +362,23 @@ void handle_request_chunked(int fd, ChunkedClientInfo &client, std::vector<Reque
     {
     case 0: // Reading headers
         if (read_headers_chunked(fd, client, global_obj, hostport_to_indexes, client_server_idx))
-        {
-            std::cout << "2222========================== : " << client.request_obj.epfd << std::endl;
-            if (process_request_headers(client))
-            {
-                if (client.upload_state == 2)
-                {
-                    send_response(fd, client);
-                    if (client.upload_state != 3)
-                        client.is_active = false;
-                }
-            }
-            else
-            {
-                sendErrorResponse(fd, 400, "Bad Request", client.request_obj.server.error_pages[400]);
-                client.is_active = false;
-            }
-        }
+            accept_request_head(fd, client);
         break;
 
     case 1: // Reading body
         if (read_body_chunk(fd, client))
         {
-            send_response(fd, client);
-            if (client.upload_state != 3)
-                client.is_active = false;
+            respond(fd, client);
             std::cout << "======> " << client.upload_state << std::endl;
         }
         break;
 
-    case 3:
-        std::cout << "kkkkkkkkk " << std::endl;
-        if (is_cgi_request(client.request_obj.path))
-        {
-            std::cout << "--------------------------------------------- --------- \n";
-            client.last_active = time(NULL);
-            if (!client.request_obj.cgj_path.empty())
-            {
-                handle_cgi_request(client, fd, client.parsed_headers);
-                return;
-            }
-        }
-        else
-        {
-            client.is_active = false;
-            break;
-        }
     case 2: // Done
         client.is_active = false;
         break;
+    case 3: // The CGI script's output resumes the client, see on_cgi_pipe_event()
+    case 4: // The next request is read once the response has drained
+    case 5: // An I/O thread is preparing the response
+        break;
     }
 }
\ No newline at end of file
@@ -0,0 +1,184 @@
+#include "server.hpp"
+#include <sys/eventfd.h>
+#include <signal.h>
+#include <deque>
+
+// Threads that run the blocking part of GET and DELETE responses: stat,
+// open, opendir/readdir and remove. A slow filesystem then only holds up
+// the requests that wait on it, not every connection of the worker.
+// Each process starts its own pool, so pre-forked workers get one too.
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_wakeup = PTHREAD_COND_INITIALIZER;
+static std::deque<IoJob *> pool_queue;
+static int pool_threads = 0;
+
+// Job the current I/O thread is running
+static __thread IoJob *current_job = NULL;
+
+// The response code finds its connection by fd; on an I/O thread that is
+// the job's record
+ChunkedClientInfo *find_io_client(int fd)
+{
+    if (current_job && current_job->client.fd == fd)
+        return &current_job->client;
+    return NULL;
+}
+
+bool on_io_thread()
+{
+    return current_job != NULL;
+}
+
+// Hand a finished job to its worker and wake the worker's loop
+static void finish_job(IoJob *job)
+{
+    Worker &worker = *job->worker;
+    pthread_mutex_lock(&worker.io_lock);
+    worker.io_finished.push_back(job);
+    pthread_mutex_unlock(&worker.io_lock);
+
+    uint64_t one = 1;
+    if (write(worker.io_done.fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+        perror("io pool: eventfd write failed");
+}
+
+static void *io_thread(void *arg)
+{
+    (void)arg;
+    while (true)
+    {
+        pthread_mutex_lock(&pool_lock);
+        while (pool_queue.empty())
+            pthread_cond_wait(&pool_wakeup, &pool_lock);
+        IoJob *job = pool_queue.front();
+        pool_queue.pop_front();
+        pthread_mutex_unlock(&pool_lock);
+
+        current_job = job;
+        send_response(job->client.fd, job->client);
+        current_job = NULL;
+        finish_job(job);
+    }
+    return NULL;
+}
+
+// Start the pool once per process. Later calls, from the other workers of
+// the process, find it running.
+bool start_io_pool(int threads)
+{
+    // SIGHUP and SIGQUIT are meant to interrupt an event loop's wait; the
+    // threads inherit a mask that keeps the kernel from picking them
+    sigset_t blocked;
+    sigset_t previous;
+    sigemptyset(&blocked);
+    sigaddset(&blocked, SIGHUP);
+    sigaddset(&blocked, SIGQUIT);
+    pthread_sigmask(SIG_BLOCK, &blocked, &previous);
+
+    pthread_mutex_lock(&pool_lock);
+    bool ok = true;
+    for (; pool_threads < threads; ++pool_threads)
+    {
+        pthread_t thread;
+        int err = pthread_create(&thread, NULL, io_thread, NULL);
+        if (err != 0)
+        {
+            std::cerr << "Failed to start I/O thread: " << strerror(err) << std::endl;
+            ok = (pool_threads > 0);
+            break;
+        }
+        pthread_detach(thread);
+    }
+    pthread_mutex_unlock(&pool_lock);
+    pthread_sigmask(SIG_SETMASK, &previous, NULL);
+    return ok;
+}
+
+// The worker's completion eventfd, watched by its epoll instance like any
+// other event source
+bool setup_io_completions(Worker &worker)
+{
+    worker.io_done.fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (worker.io_done.fd == -1)
+    {
+        perror("eventfd failed");
+        return false;
+    }
+    pthread_mutex_init(&worker.io_lock, NULL);
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = &worker.io_done;
+    if (epoll_ctl(worker.epfd, EPOLL_CTL_ADD, worker.io_done.fd, &ev) == -1)
+    {
+        perror("epoll_ctl: io eventfd");
+        close(worker.io_done.fd);
+        worker.io_done.fd = -1;
+        return false;
+    }
+    return true;
+}
+
+// Give the job what send_response() reads for a GET or DELETE, and nothing
+// else. The head, the locations and the error pages are swapped rather than
+// copied: the connection leaves them alone while it waits in state 5, and
+// return_response_context() gives them back.
+static void take_response_context(ChunkedClientInfo &job, ChunkedClientInfo &client)
+{
+    job.fd = client.fd;
+    job.is_active = client.is_active;
+    job.keep_alive = client.keep_alive;
+    job.transfer_encod = client.transfer_encod;
+    job.content_length = client.content_length;
+    job.body_received = client.body_received;
+    job.config = client.config;
+    job.headers.swap(client.headers);
+    job.parser = client.parser;
+
+    Request &request = job.request_obj;
+    Request &from = client.request_obj;
+    request.method = from.method;
+    request.outcome = from.outcome;
+    request.path = from.path;
+    request.uri = from.uri;
+    request.root = from.root;
+    request.mimitype = from.mimitype;
+    request.local_data.swap(from.local_data);
+    request.server.error_pages.swap(from.server.error_pages);
+}
+
+// The job is back: the connection gets its request context again
+void return_response_context(ChunkedClientInfo &client, IoJob &job)
+{
+    client.headers.swap(job.client.headers);
+    client.request_obj.local_data.swap(job.client.request_obj.local_data);
+    client.request_obj.server.error_pages.swap(job.client.request_obj.server.error_pages);
+}
+
+// Queue the client's response for an I/O thread. Returns false when there
+// is no pool or its queue is full; the caller then answers inline.
+bool submit_io_job(Worker &worker, ChunkedClientInfo &client)
+{
+    if (worker.io_done.fd == -1)
+        return false;
+
+    pthread_mutex_lock(&pool_lock);
+    bool full = (pool_threads == 0 || pool_queue.size() >= IO_QUEUE_MAX);
+    pthread_mutex_unlock(&pool_lock);
+    if (full)
+        return false;
+
+    IoJob *job = new IoJob();
+    job->worker = &worker;
+    job->ref = ClientRef(client.fd, client.generation);
+    take_response_context(job->client, client);
+    // The connection may close while the job runs
+    retain_config(job->client.config);
+
+    pthread_mutex_lock(&pool_lock);
+    pool_queue.push_back(job);
+    pthread_cond_signal(&pool_wakeup);
+    pthread_mutex_unlock(&pool_lock);
+    return true;
+}
@@ -0,0 +1,89 @@
+#include "server.hpp"
+
+void OutputQueue::append(const char *data, size_t size)
+{
+    if (size == 0)
+        return;
+    // Start a new segment unless the data fits behind the last one
+    if (used == 0 || segments[used - 1].size() + size > OUTPUT_SEGMENT_SIZE)
+    {
+        if (used == segments.size())
+            segments.push_back(std::string());
+        segments[used].clear();
+        used++;
+    }
+    segments[used - 1].append(data, size);
+    pending += size;
+}
+
+// Queue the bytes another queue still holds, behind this queue's own
+void OutputQueue::append(const OutputQueue &other)
+{
+    for (size_t i = other.head; i < other.used; ++i)
+    {
+        size_t skip = (i == other.head) ? other.offset : 0;
+        append(other.segments[i].data() + skip, other.segments[i].size() - skip);
+    }
+}
+
+// Write as much as the socket takes without blocking
+ssize_t OutputQueue::flush(int fd)
+{
+    ssize_t total = 0;
+
+    while (pending > 0)
+    {
+        struct iovec iov[OUTPUT_IOV_MAX];
+        size_t count = 0;
+        for (size_t i = head; i < used && count < OUTPUT_IOV_MAX; ++i, ++count)
+        {
+            size_t skip = (i == head) ? offset : 0;
+            iov[count].iov_base = const_cast<char *>(segments[i].data() + skip);
+            iov[count].iov_len = segments[i].size() - skip;
+        }
+
+        struct msghdr msg;
+        std::memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = count;
+        ssize_t sent = sendmsg(fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (sent < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            return -1;
+        }
+
+        total += sent;
+        pending -= sent;
+        size_t left = sent;
+        while (left > 0)
+        {
+            size_t in_head = segments[head].size() - offset;
+            if (left < in_head)
+            {
+                offset += left;
+                break;
+            }
+            left -= in_head;
+            head++;
+            offset = 0;
+        }
+    }
+
+    if (pending == 0)
+        clear();
+    return total;
+}
+
+void OutputQueue::clear()
+{
+    for (size_t i = 0; i < used; ++i)
+        segments[i].clear();
+    head = 0;
+    used = 0;
+    offset = 0;
+    pending = 0;
+}
@@ -0,0 +1,86 @@
+#include "server.hpp"
+
+// Load shedding. A worker whose loop falls behind stops taking on more
+// work instead of slowing down every connection it has: it pauses its
+// listeners and answers new requests with a prebuilt 503. Requests already
+// being served run to completion, which keeps goodput up under overload.
+// Where new connections go meanwhile depends on the listeners, see
+// pause_listeners(): worker threads hand the paused worker's share to the
+// others, pre-forked workers keep accepting from the shared socket, and a
+// single worker's connections wait in its accept queue.
+
+// Build the worker's 503 once, so shedding a request costs one append
+void setup_overload(Worker &worker)
+{
+    std::string body = "<html><body><h1>503 Service Unavailable</h1>"
+                       "<p>The server is overloaded, try again shortly.</p></body></html>";
+    std::ostringstream response;
+    response << "HTTP/1.1 503 Service Unavailable\r\n"
+             << "Content-Type: text/html\r\n"
+             << "Content-Length: " << body.size() << "\r\n"
+             << "Retry-After: " << worker.global->overload_retry_after << "\r\n"
+             << "Connection: close\r\n\r\n"
+             << body;
+    worker.overload.response = response.str();
+}
+
+static long elapsed_us(const struct timespec &from, const struct timespec &to)
+{
+    return (to.tv_sec - from.tv_sec) * 1000000L + (to.tv_nsec - from.tv_nsec) / 1000;
+}
+
+// After each batch: woke is when the wait returned and queued the number
+// of clients that were waiting for another turn then. The time since woke
+// is how long the last event of the batch waited to be handled; smoothed,
+// it is the loop lag. A worker starts shedding once the lag or the queue
+// passes its threshold, and stops once both are back under half of it,
+// after OVERLOAD_HOLD seconds at least, so it does not flap.
+void update_overload(Worker &worker, const struct timespec &woke, size_t queued)
+{
+    const GlobalConfig &global = *worker.global;
+    OverloadState &state = worker.overload;
+    if (global.overload_lag == 0 && global.overload_queue == 0)
+        return;
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    state.lag_us += (elapsed_us(woke, now) - state.lag_us) / 8;
+    state.queued = queued;
+
+    long lag_limit = global.overload_lag * 1000L;
+    size_t queue_limit = global.overload_queue;
+    if (!state.shedding)
+    {
+        bool lagging = lag_limit > 0 && state.lag_us > lag_limit;
+        bool backlogged = queue_limit > 0 && queued > queue_limit;
+        if (!lagging && !backlogged)
+            return;
+        state.shedding = true;
+        state.since = worker.now;
+        state.shed = 0;
+        pause_listeners(worker);
+        std::cerr << "Worker " << worker.id << " overloaded (loop lag " << state.lag_us / 1000 << " ms, "
+                  << queued << " clients queued): pausing accepts, answering 503" << std::endl;
+        return;
+    }
+
+    bool lagging = lag_limit > 0 && state.lag_us > lag_limit / 2;
+    bool backlogged = queue_limit > 0 && queued > queue_limit / 2;
+    if (lagging || backlogged || worker.now - state.since < OVERLOAD_HOLD)
+        return;
+    state.shedding = false;
+    resume_listeners(worker);
+    std::cerr << "Worker " << worker.id << " recovered after " << worker.now - state.since << " s, "
+              << state.shed << " requests answered 503" << std::endl;
+}
+
+// A shedding loop may go quiet because it stopped accepting: wake it up
+// regularly so the lag decays and the listeners come back
+int overload_timeout(const Worker &worker, int timeout)
+{
+    if (!worker.overload.shedding)
+        return timeout;
+    if (timeout < 0 || timeout > OVERLOAD_CHECK_MS)
+        return OVERLOAD_CHECK_MS;
+    return timeout;
+}
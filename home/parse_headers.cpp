@@ -1,122 +1,83 @@
 #include "server.hpp"
+#include <climits>
 
-void parse_headers(std::istringstream &stream, std::map<std::string, std::string> &headers, ChunkedClientInfo &client)
+// Value of a known header of the current request, a view into
+// client.headers; empty when the request does not have it
+StrView request_header(const ChunkedClientInfo &client, HeaderId id)
 {
-    std::string line;
-    while (std::getline(stream, line))
-    {
-        // Remove carriage return if present
-        if (!line.empty() && line[line.size() - 1] == '\r')
-            line.erase(line.size() - 1);
-
-        if (line.empty())
-            break;
-
-        size_t pos = line.find(":");
-        if (pos != std::string::npos && pos > 0)
-        {
-            std::string key = line.substr(0, pos);
-            std::string value = line.substr(pos + 1);
-            if (key == "Host")
-            {
-                if (value.empty())
-                {
-                    std::cerr << "Host header is empty!" << std::endl;
-                    continue; // Skip empty Host header
-                }
-                else
-                {
-                    size_t pos1 = value.find(":");
-                    if (pos1 != std::string::npos && pos1 > 0)
-                    {
-                        std::string key1 = value.substr(1, pos1 - 1);
-                        std::string value1 = value.substr(pos1 + 1);
-                        client.request_obj.server_host = key1;
-                        client.request_obj.server_port = strtol(value1.c_str(), NULL, 10);
-                    }
-                }
-            };
-
-            // Trim whitespace from value
-            size_t start = value.find_first_not_of(" \t");
-            if (start != std::string::npos)
-                value = value.substr(start);
-
-            headers[key] = value;
-        }
-    }
+    return client.parser.header(client.headers, id);
 }
 
-// Parse method line and extract request information
+// Take the request line and the Host header out of the parsed head
 bool parse_method_line(ChunkedClientInfo &client)
 {
-    std::istringstream method_stream(client.headers);
-    std::string method_line;
-    if (std::getline(method_stream, method_line))
-    {
-        parsing_method(client.request_obj, method_line);
-        parse_headers(method_stream, client.parsed_headers, client);
+    const RequestParser &parser = client.parser;
+    const std::string &head = client.headers;
+    if (parser.method(head).empty())
+        return false;
+    parsing_method(client.request_obj, parser.method(head), parser.target(head), parser.version(head));
+
+    StrView host = request_header(client, HEADER_HOST);
+    if (host.empty())
         return true;
+    const char *colon = static_cast<const char *>(memchr(host.data, ':', host.size));
+    if (colon && colon > host.data)
+    {
+        client.request_obj.server_host.assign(host.data, colon - host.data);
+        client.request_obj.server_port = strtol(colon + 1, NULL, 10);
     }
-    return false;
+    return true;
 }
 
-// Extract content length from headers
-void extract_content_length(ChunkedClientInfo &client)
+// A Content-Length is digits only, no sign and no spaces, and has to fit
+// in a long long
+static bool parse_content_length(StrView length, long long &value)
 {
-    std::map<std::string, std::string>::iterator it = client.parsed_headers.find("Content-Length");
-    if (it != client.parsed_headers.end())
+    value = 0;
+    for (size_t i = 0; i < length.size; ++i)
     {
-        client.content_length = atoll(it->second.c_str());
-    }
-    else
-    {
-        std::map<std::string, std::string>::iterator it = client.parsed_headers.find("Transfer-Encoding");
-        if (it != client.parsed_headers.end())
-        {
-            client.transfer_encod = it->second;
-        }
+        char c = length.data[i];
+        if (c < '0' || c > '9' || value > (LLONG_MAX - (c - '0')) / 10)
+            return false;
+        value = value * 10 + (c - '0');
     }
+    return true;
 }
 
-// Check if headers are complete in received data
-bool check_headers_complete(ChunkedClientInfo &client)
+// Take the body framing out of the parsed head; false on a Content-Length
+// that is not a number
+bool extract_content_length(ChunkedClientInfo &client)
 {
-    size_t header_end = client.partial_data.find("\r\n\r\n");
-    if (header_end != std::string::npos)
+    StrView length = request_header(client, HEADER_CONTENT_LENGTH);
+    if (!length.empty())
     {
-        client.headers = client.partial_data.substr(0, header_end);
-        client.partial_data = client.partial_data.substr(header_end + 4);
-        client.headers_complete = true;
+        long long value;
+        if (!parse_content_length(length, value))
+            return false;
+        client.content_length = value;
         return true;
     }
-    return false;
+    StrView encoding = request_header(client, HEADER_TRANSFER_ENCODING);
+    if (!encoding.empty())
+        client.transfer_encod = encoding.str();
+    return true;
 }
 
-// Find the right server config (index) based on Host header.
-// If no match → return the default for this socket.
-std::string extract_host_header(const std::string &raw_headers)
+// Bytes past the end of this request's body belong to the requests the
+// client pipelined behind it. They wait in client.pipelined until this one
+// is answered. A chunked body has no known end, so it keeps everything.
+void split_pipelined_input(ChunkedClientInfo &client)
 {
-    std::istringstream stream(raw_headers);
-    std::string line;
-    while (std::getline(stream, line))
+    if (!client.transfer_encod.empty())
+        return;
+    size_t body = client.content_length > 0 ? static_cast<size_t>(client.content_length) : 0;
+    if (client.partial_data.size() > body)
     {
-        if (line.find("Host:") == 0)
-        {
-            size_t pos = line.find(":");
-            if (pos != std::string::npos)
-            {
-                std::string host = line.substr(pos + 1);
-                while (!host.empty() && (host[0] == ' ' || host[0] == '\t'))
-                    host.erase(0, 1);
-                while (!host.empty() && (host[host.size() - 1] == '\r' || host[host.size() - 1] == '\n'))
-                    host.erase(host.size() - 1);
-                return host;
-            }
-        }
+        client.pipelined.assign(client.partial_data, body, std::string::npos);
+        client.partial_data.erase(body);
     }
-    return "";
 }
+
 size_t resolve_server_index(const std::string &host_header,
                             const std::vector<Request> &global_obj,
                             const std::map<std::string, std::vector<size_t> > &hostport_to_indexes, size_t client_server_idx)
@@ -156,18 +117,57 @@ bool read_headers_chunked(int fd,
                           size_t client_server_idx)
 {
     char buffer[CHUNK_SIZE];
-    ssize_t bytes_read = read(fd, buffer, sizeof(buffer));
-
-    if (bytes_read > 0)
+    ssize_t bytes_read = 0;
+    // A pipelined request may be buffered in full already
+    RequestParser::Status status = client.parser.parse(client.partial_data.data(), client.partial_data.size());
+    bool buffered = status != RequestParser::PARSE_INCOMPLETE;
+    if (!buffered)
+        bytes_read = read_client(fd, buffer, sizeof(buffer), client);
+
+    if (buffered || bytes_read > 0)
     {
-        client.partial_data.append(buffer, bytes_read);
-        client.last_active = time(NULL);
+        if (bytes_read > 0)
+        {
+            client.partial_data.append(buffer, bytes_read);
+            client.last_active = time(NULL);
+            // Only the new bytes are parsed
+            status = client.parser.parse(client.partial_data.data(), client.partial_data.size());
+        }
 
-        if (check_headers_complete(client))
+        if (status == RequestParser::PARSE_ERROR)
+        {
+            // Not HTTP: answered with a 400 once, then closed
+            client.keep_alive = false;
+            sendErrorResponse(fd, 400, "Bad Request", global_obj[client_server_idx].server.error_pages[400]);
+            client.is_active = false;
+            return false;
+        }
+        size_t head_size = status == RequestParser::PARSE_DONE ? client.parser.head_size() : client.partial_data.size();
+        if (head_size > MAX_HEAD_SIZE)
+        {
+            // Without the cap a client could grow partial_data for as long
+            // as it keeps sending header lines
+            client.keep_alive = false;
+            std::map<int, std::string> &pages = global_obj[client_server_idx].server.error_pages;
+            sendErrorResponse(fd, 431, "Request Header Fields Too Large",
+                              pages.count(431) ? pages[431] : pages[400]);
+            client.is_active = false;
+            return false;
+        }
+        if (status == RequestParser::PARSE_DONE)
         {
-            std::string host = extract_host_header(client.headers);
-            size_t server_index = resolve_server_index(host, global_obj, hostport_to_indexes, client_server_idx);
+            // The head stays in the buffer it was received into, where the
+            // parser's spans point; only the body bytes behind it move
+            client.headers.swap(client.partial_data);
+            client.partial_data.assign(client.headers, head_size, std::string::npos);
+            client.headers.resize(head_size);
+            client.headers_complete = true;
+
+            StrView host = request_header(client, HEADER_HOST);
+            size_t server_index = resolve_server_index(host.str(), global_obj, hostport_to_indexes, client_server_idx);
             client.server_index = server_index;
+            // The request context is only built here, once a request
+            // arrived and its server block is known
             client.request_obj.server = global_obj[server_index].server;
             client.request_obj.root = global_obj[server_index].root;
             client.request_obj.server_port = global_obj[server_index].server_port;
@@ -177,7 +177,15 @@ bool read_headers_chunked(int fd,
 
             if (parse_method_line(client))
             {
-                extract_content_length(client);
+                if (!extract_content_length(client))
+                {
+                    client.keep_alive = false;
+                    sendErrorResponse(fd, 400, "Bad Request", client.request_obj.server.error_pages[400]);
+                    client.is_active = false;
+                    return false;
+                }
+                split_pipelined_input(client);
+                client.body_received = client.partial_data.size();
 
                 std::cout << "Headers parsed - Method: " << client.request_obj.mthod
                           << ", Path: " << client.request_obj.path
@@ -192,6 +200,10 @@ bool read_headers_chunked(int fd,
         client.is_active = false;
         return false;
     }
+    else if (client.socket_drained)
+    {
+        return false;
+    }
     else if (bytes_read < 0)
     {
         perror("Read headers failed");
@@ -299,7 +311,9 @@ bool process_multipart_request(ChunkedClientInfo &client, const std::string &con
 // Process URL encoded form data
 bool process_urlencoded_request(ChunkedClientInfo &client)
 {
+    // Accounts are shared by every worker thread
     static std::map<std::string, std::string> post_res;
+    static pthread_mutex_t post_res_lock = PTHREAD_MUTEX_INITIALIZER;
     std::map<std::string, std::string> form_data;
 
     std::istringstream ss(client.partial_data);
@@ -315,8 +329,10 @@ bool process_urlencoded_request(ChunkedClientInfo &client)
         }
     }
 
+    pthread_mutex_lock(&post_res_lock);
     client.request_obj.path = Format_urlencoded(client.request_obj.path, post_res,
                                                 form_data, client.request_obj);
+    pthread_mutex_unlock(&post_res_lock);
 
     if (client.request_obj.path.empty())
     {
@@ -0,0 +1,349 @@
+#include "server.hpp"
+#include <climits>
+
+// Request head parsing. The parser walks the receive buffer once, in
+// whatever pieces the head arrives, and only remembers offsets: the head
+// is not copied, split into lines or put into a map.
+
+// Characters of a method or a header name (tchar in RFC 9110), looked up
+// in a table filled once during static initialization
+struct TokenTable
+{
+    bool allowed[256];
+
+    TokenTable()
+    {
+        for (int c = 0; c < 256; ++c)
+        {
+            allowed[c] = (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') ||
+                         (c != 0 && std::strchr("!#$%&'*+-.^_`|~", c) != NULL);
+        }
+    }
+};
+
+static const TokenTable token_table;
+
+static bool is_token_char(unsigned char c)
+{
+    return token_table.allowed[c];
+}
+
+static bool is_blank(char c)
+{
+    return c == ' ' || c == '\t';
+}
+
+static char lower(char c)
+{
+    return (c >= 'A' && c <= 'Z') ? static_cast<char>(c - 'A' + 'a') : c;
+}
+
+// Names of the known fields, by HeaderId
+static const char *const header_names[HEADER_OTHER] = {
+    "Host",
+    "Connection",
+    "Keep-Alive",
+    "Content-Length",
+    "Content-Type",
+    "Transfer-Encoding",
+    "Expect",
+    "Range",
+    "If-None-Match",
+    "If-Modified-Since",
+    "Cache-Control",
+    "Cookie",
+    "Authorization",
+    "User-Agent",
+    "Accept",
+    "Accept-Encoding",
+    "Accept-Language",
+    "Referer",
+    "Origin",
+    "Upgrade",
+};
+
+// Slots of the perfect hash in header_id(). The hash has no collisions
+// among the known names; add a name and it has to be checked again.
+static const HeaderId header_slots[64] = {
+    HEADER_OTHER, HEADER_REFERER, HEADER_OTHER, HEADER_CONTENT_TYPE,
+    HEADER_ACCEPT_LANGUAGE, HEADER_OTHER, HEADER_OTHER, HEADER_OTHER,
+    HEADER_OTHER, HEADER_KEEP_ALIVE, HEADER_OTHER, HEADER_RANGE,
+    HEADER_ACCEPT_ENCODING, HEADER_OTHER, HEADER_IF_MODIFIED_SINCE, HEADER_USER_AGENT,
+    HEADER_UPGRADE, HEADER_CONTENT_LENGTH, HEADER_OTHER, HEADER_OTHER,
+    HEADER_OTHER, HEADER_OTHER, HEADER_IF_NONE_MATCH, HEADER_OTHER,
+    HEADER_OTHER, HEADER_OTHER, HEADER_OTHER, HEADER_OTHER,
+    HEADER_OTHER, HEADER_OTHER, HEADER_OTHER, HEADER_OTHER,
+    HEADER_CACHE_CONTROL, HEADER_TRANSFER_ENCODING, HEADER_OTHER, HEADER_OTHER,
+    HEADER_OTHER, HEADER_CONNECTION, HEADER_AUTHORIZATION, HEADER_OTHER,
+    HEADER_OTHER, HEADER_OTHER, HEADER_OTHER, HEADER_OTHER,
+    HEADER_OTHER, HEADER_ORIGIN, HEADER_OTHER, HEADER_OTHER,
+    HEADER_OTHER, HEADER_OTHER, HEADER_OTHER, HEADER_OTHER,
+    HEADER_OTHER, HEADER_OTHER, HEADER_OTHER, HEADER_ACCEPT,
+    HEADER_OTHER, HEADER_OTHER, HEADER_OTHER, HEADER_EXPECT,
+    HEADER_HOST, HEADER_COOKIE, HEADER_OTHER, HEADER_OTHER,
+};
+
+// Id of a field name, in any case. The slot comes from the length and the
+// first and last bytes, folded to lower case with | 0x20 (which leaves
+// the other token characters alike in every spelling); one compare with
+// the name in that slot confirms it.
+HeaderId header_id(const char *name, size_t length)
+{
+    if (length == 0)
+        return HEADER_OTHER;
+    unsigned first = static_cast<unsigned char>(name[0]) | 0x20;
+    unsigned last = static_cast<unsigned char>(name[length - 1]) | 0x20;
+    HeaderId id = header_slots[(length + first + 4 * last) & 63];
+    if (id == HEADER_OTHER || !StrView(name, length).equals_nocase(header_names[id]))
+        return HEADER_OTHER;
+    return id;
+}
+
+static Span make_span(unsigned from, unsigned to)
+{
+    Span span;
+    span.offset = from;
+    span.length = to - from;
+    return span;
+}
+
+bool StrView::equals_nocase(const char *text) const
+{
+    size_t i = 0;
+    for (; i < size && text[i]; ++i)
+    {
+        if (lower(data[i]) != lower(text[i]))
+            return false;
+    }
+    return i == size && !text[i];
+}
+
+bool StrView::contains_nocase(const char *text) const
+{
+    size_t length = std::strlen(text);
+    for (size_t at = 0; at + length <= size; ++at)
+    {
+        size_t i = 0;
+        while (i < length && lower(data[at + i]) == lower(text[i]))
+            ++i;
+        if (i == length)
+            return true;
+    }
+    return false;
+}
+
+void RequestParser::reset()
+{
+    state = S_LINE_START;
+    pos = 0;
+    start = 0;
+    method_span = Span();
+    target_span = Span();
+    version_span = Span();
+    field = HEADER_OTHER;
+    known_fields = 0;
+    count = 0;
+}
+
+// Continue parsing the head in data[0, size). Bytes before the stop of the
+// previous call are not looked at again. Returns PARSE_DONE once the blank
+// line ending the head was reached, and PARSE_ERROR, for good, on a head
+// that is not HTTP: control bytes in the request line, a field without a
+// name or colon, a folded field, or more than MAX_HEADERS unknown fields. Empty
+// lines before the request line are skipped, bare LF ends a line like
+// CRLF, and a request line without a version is accepted as before.
+RequestParser::Status RequestParser::parse(const char *data, size_t size)
+{
+    if (size > UINT_MAX)
+        size = UINT_MAX;
+    while (pos < size && state != S_DONE && state != S_ERROR)
+    {
+        char c = data[pos];
+        switch (state)
+        {
+        case S_LINE_START:
+            if (c == '\r' || c == '\n')
+            {
+                ++pos;
+                break;
+            }
+            start = pos;
+            state = S_METHOD;
+            break;
+
+        case S_METHOD:
+            while (pos < size && is_token_char(data[pos]))
+                ++pos;
+            if (pos == size)
+                break;
+            if (data[pos] != ' ' || pos == start)
+            {
+                state = S_ERROR;
+                break;
+            }
+            method_span = make_span(start, pos);
+            state = S_TARGET_START;
+            break;
+
+        case S_TARGET_START:
+            if (c == ' ')
+            {
+                ++pos;
+                break;
+            }
+            start = pos;
+            state = S_TARGET;
+            break;
+
+        case S_TARGET:
+            pos += scan_target_end(data + pos, size - pos);
+            if (pos == size)
+                break;
+            if (pos == start)
+            {
+                state = S_ERROR;
+                break;
+            }
+            target_span = make_span(start, pos);
+            if (data[pos] == ' ')
+                state = S_VERSION_START;
+            else if (data[pos] == '\r' || data[pos] == '\n')
+                state = S_LINE_END;
+            else
+                state = S_ERROR;
+            break;
+
+        case S_VERSION_START:
+            if (c == ' ')
+            {
+                ++pos;
+                break;
+            }
+            start = pos;
+            state = S_VERSION;
+            break;
+
+        case S_VERSION:
+            pos += scan_line_end(data + pos, size - pos);
+            if (pos == size)
+                break;
+            {
+                unsigned end = pos;
+                while (end > start && is_blank(data[end - 1]))
+                    --end;
+                version_span = make_span(start, end);
+            }
+            state = S_LINE_END;
+            break;
+
+        case S_LINE_END:
+            ++pos;
+            state = (c == '\r') ? S_LINE_LF : S_FIELD_START;
+            break;
+
+        case S_LINE_LF:
+            ++pos;
+            state = (c == '\n') ? S_FIELD_START : S_ERROR;
+            break;
+
+        case S_FIELD_START:
+            if (c == '\r' || c == '\n')
+            {
+                ++pos;
+                state = (c == '\r') ? S_END_LF : S_DONE;
+                break;
+            }
+            if (is_blank(c))
+            {
+                state = S_ERROR;
+                break;
+            }
+            start = pos;
+            state = S_NAME;
+            break;
+
+        case S_NAME:
+            while (pos < size && is_token_char(data[pos]))
+                ++pos;
+            if (pos == size)
+                break;
+            if (data[pos] != ':' || pos == start)
+            {
+                state = S_ERROR;
+                break;
+            }
+            field = header_id(data + start, pos - start);
+            if (field == HEADER_OTHER)
+            {
+                if (count == MAX_HEADERS)
+                {
+                    state = S_ERROR;
+                    break;
+                }
+                fields[count].name = make_span(start, pos);
+            }
+            ++pos;
+            state = S_VALUE_START;
+            break;
+
+        case S_VALUE_START:
+            if (is_blank(c))
+            {
+                ++pos;
+                break;
+            }
+            start = pos;
+            state = S_VALUE;
+            break;
+
+        case S_VALUE:
+            pos += scan_line_end(data + pos, size - pos);
+            if (pos == size)
+                break;
+            {
+                unsigned end = pos;
+                while (end > start && is_blank(data[end - 1]))
+                    --end;
+                if (field == HEADER_OTHER)
+                    fields[count++].value = make_span(start, end);
+                else
+                {
+                    known[field] = make_span(start, end);
+                    known_fields |= 1u << field;
+                }
+            }
+            state = S_LINE_END;
+            break;
+
+        case S_END_LF:
+            ++pos;
+            state = (c == '\n') ? S_DONE : S_ERROR;
+            break;
+
+        case S_DONE:
+        case S_ERROR:
+            break;
+        }
+    }
+    if (state == S_DONE)
+        return PARSE_DONE;
+    if (state == S_ERROR)
+        return PARSE_ERROR;
+    return PARSE_INCOMPLETE;
+}
+
+// Value of the named field, matched without regard to case. Empty when
+// the request has no such field. Known names should be looked up by id.
+StrView RequestParser::header(const std::string &buffer, const char *name) const
+{
+    HeaderId id = header_id(name, std::strlen(name));
+    if (id != HEADER_OTHER)
+        return header(buffer, id);
+    StrView value;
+    for (unsigned i = 0; i < count; ++i)
+    {
+        if (other_name(buffer, i).equals_nocase(name))
+            value = other_value(buffer, i);
+    }
+    return value;
+}
@@ -1,4 +1,6 @@
 #include "server.hpp"
+#include <algorithm>
+#include <signal.h>
 // Process request headers based on method
 bool process_request_headers(ChunkedClientInfo &client)
 {
@@ -20,11 +22,11 @@ bool process_request_headers(ChunkedClientInfo &client)
                     client.request_obj.response_red = "HTTP/1.1 302 Found\r\n";
                     client.request_obj.response_red += "Location: " + client.request_obj.local_data[i].redirection + "\r\n";
                     client.request_obj.response_red += "Content-Length: 0\r\n";
-                    client.request_obj.response_red += "Connection: close\r\n\r\n";
+                    client.request_obj.response_red += connection_header(client.fd) + "\r\n";
 
                     client.upload_state = 2;
                     client.request_obj.found_redirection = true;
-                    client.request_obj.mthod = "Redirection";
+                    client.request_obj.outcome = OUTCOME_REDIRECT;
                     return true;
                 }
             }
@@ -44,18 +46,11 @@ bool process_request_headers(ChunkedClientInfo &client)
             if (index_path == location_path)
             {
                 found_local = true;
-                if (client.request_obj.local_data[i].methods.empty())
+                if (client.request_obj.local_data[i].allowed_methods & client.request_obj.method)
                 {
                     found_method = true;
                     break;
                 }
-                for (size_t j = 0; j < client.request_obj.local_data[i].methods.size(); j++)
-                {
-                    if (client.request_obj.mthod == client.request_obj.local_data[i].methods[j])
-                        found_method = true;
-                }
-                if (found_method)
-                    break;
             }
         }
         if (found_method == true || found_local == true || index_path == "/" )
@@ -65,56 +60,40 @@ bool process_request_headers(ChunkedClientInfo &client)
     if (found_method == false)
     {
         client.upload_state = 2;
-        client.request_obj.mthod = "method not found";
+        client.request_obj.outcome = OUTCOME_METHOD_NOT_ALLOWED;
         return true;
     }
-    if ((client.request_obj.mthod == "POST"))
-    {
-        if (client.request_obj.server.client_max_body_size <= 0 || client.request_obj.server.client_max_body_size <= client.content_length)
-        {
-            client.request_obj.mthod = "content_length";
-            client.upload_state = 2;
-            return true;
-        }
-    }
-    if (client.request_obj.mthod == "GET")
+    if (client.request_obj.method != METHOD_POST)
     {
         client.upload_state = 2;
         return true;
     }
-    else if (client.request_obj.mthod == "DELETE")
+    if (client.request_obj.server.client_max_body_size <= 0 || client.request_obj.server.client_max_body_size <= client.content_length)
     {
+        client.request_obj.outcome = OUTCOME_TOO_LARGE;
         client.upload_state = 2;
         return true;
     }
-    else if (client.request_obj.mthod == "POST")
+    if (process_post_request(client))
     {
-        if (process_post_request(client))
+        if (client.upload_state != 2)
         {
-            if (client.upload_state != 2)
-            {
-                client.upload_state = 1;
-                client.bytes_read = 0;
-            }
-            return true;
+            client.upload_state = 1;
+            client.bytes_read = 0;
         }
-        return false;
-    }
-    else
-    {
-        client.upload_state = 2;
         return true;
     }
+    return false;
 }
 
-struct ServerInfo
+// Server blocks sharing an address share its socket: take the longest backlog
+static int listen_backlog(const std::vector<Request> &global_obj, const std::vector<size_t> &indexes)
 {
-    int socket_fd;
-    size_t config_index;
-
-    ServerInfo() : socket_fd(-1), config_index(0) {}
-    ServerInfo(int fd, size_t idx) : socket_fd(fd), config_index(idx) {}
-};
+    int backlog = 0;
+    for (size_t i = 0; i < indexes.size(); ++i)
+        backlog = std::max(backlog, global_obj[indexes[i]].server.backlog);
+    return backlog;
+}
 
 void setup_all_sockets(std::vector<ServerInfo> &servers, std::vector<Request> &global_obj,
                        std::map<std::string, std::vector<size_t> > &hostport_to_indexes,
@@ -128,143 +107,89 @@ void setup_all_sockets(std::vector<ServerInfo> &servers, std::vector<Request> &g
 
         // Use the first config as default
         Request &default_request = global_obj[indexes[0]];
+        int backlog = listen_backlog(global_obj, indexes);
 
-        int socket_fd = setup_server_socket(default_request);
+        int socket_fd = setup_server_socket(default_request, backlog);
         if (socket_fd == -1)
         {
             std::cerr << "Failed to set up socket for: " << it->first << std::endl;
             continue;
         }
-        servers.push_back(ServerInfo(socket_fd, indexes[0]));
+        servers.push_back(ServerInfo(socket_fd, indexes[0], backlog, it->first));
 
         socket_fd_to_default_index[socket_fd] = indexes[0];
     }
 }
-// Main server loop
-int main()
-{
-    std::map<std::string, std::vector<size_t> > hostport_to_indexes;
-    std::map<int, size_t> socket_fd_to_default_index;
-    std::vector<Request> global_obj;
 
-    if (!initialize_server_config(global_obj, hostport_to_indexes))
-    {
-        std::cerr << "Failed to initialize server configuration." << std::endl;
-        return 1;
-    }
-    // Create all server sockets
-    std::vector<ServerInfo> servers;
-    // Reserve space for server sockets based on the number of configurations
-    servers.reserve(global_obj.size());
-
-    setup_all_sockets(servers, global_obj, hostport_to_indexes, socket_fd_to_default_index);
-    // Create a single epoll instance for all servers
-    int epfd = epoll_create1(0);
-    if (epfd == -1)
-    {
-        perror("epoll_create1 failed");
-        // Cleanup sockets
-        for (size_t i = 0; i < servers.size(); ++i)
-        {
-            close(servers[i].socket_fd);
-        }
-        return 1;
-    }
-
-    std::cout << "11========================== : " << epfd <<std::endl;
-
-    // Add all server sockets to epoll
+// Bring a listener set in line with a reloaded configuration. A listener
+// whose address is still configured keeps its socket, and with it the
+// connections waiting in its accept queue; new addresses get a socket
+// appended to servers. Returns the listeners whose address is gone: the
+// caller stops watching and closes them. Slots are never reused, so a
+// listener index stays valid while an accept on it is in flight.
+std::vector<size_t> sync_listeners(std::vector<ServerInfo> &servers, ConfigSnapshot &config)
+{
+    std::vector<size_t> stopped;
+    std::map<std::string, size_t> kept;
     for (size_t i = 0; i < servers.size(); ++i)
     {
-        struct epoll_event ev;
-        ev.events = EPOLLIN;
-        ev.data.fd = servers[i].socket_fd;
-        //  std::cout << "Adding server socket " << servers[i].socket_fd << " to epoll" << std::endl;
-
-        if (epoll_ctl(epfd, EPOLL_CTL_ADD, servers[i].socket_fd, &ev) == -1)
-        {
-            perror("epoll_ctl: server socket");
-            close(epfd);
-            for (size_t j = 0; j < servers.size(); ++j)
-            {
-                close(servers[j].socket_fd);
-            }
-            return 1;
-        }
+        if (servers[i].socket_fd == -1)
+            continue;
+        if (config.hostport_to_indexes.count(servers[i].address))
+            kept[servers[i].address] = i;
+        else
+            stopped.push_back(i);
     }
 
-    std::map<int, ChunkedClientInfo> clients;
-
-    while (true)
+    for (std::map<std::string, std::vector<size_t> >::iterator it = config.hostport_to_indexes.begin();
+         it != config.hostport_to_indexes.end(); ++it)
     {
-        struct epoll_event events[MAX_EVENTS];
-        int nfds = epoll_wait(epfd, events, MAX_EVENTS, 2000);
+        const std::vector<size_t> &indexes = it->second;
+        if (indexes.empty())
+            continue;
+        int backlog = listen_backlog(config.global_obj, indexes);
 
-        if (nfds < 0)
+        std::map<std::string, size_t>::iterator found = kept.find(it->first);
+        if (found != kept.end())
         {
-            perror("epoll_wait failed");
+            ServerInfo &server = servers[found->second];
+            server.config_index = indexes[0];
+            // listen() on a listening socket only resizes its accept queue
+            if (server.backlog != backlog && listen(server.socket_fd, backlog) == 0)
+                server.backlog = backlog;
             continue;
         }
 
-        for (int i = 0; i < nfds; i++)
+        int socket_fd = setup_server_socket(config.global_obj[indexes[0]], backlog);
+        if (socket_fd == -1)
         {
-            int fd = events[i].data.fd;
-            // Check if this is a server socket (new connection)
-            bool is_server_socket = false;
-            size_t server_idx = SIZE_MAX;
-
-            // Find which server socket this is
-            for (size_t j = 0; j < servers.size(); j++)
-            {
-                if (servers[j].socket_fd == fd)
-                {
-                    is_server_socket = true;
-                    server_idx = servers[j].config_index;
-                    break;
-                }
-            }
-
-            if (is_server_socket && (events[i].events & EPOLLIN))
-            {
-                // Handle new connection for this specific server
-                handle_new_connections(fd, epfd, clients, global_obj[server_idx], server_idx);
-            }
-            else if (events[i].events & EPOLLIN)
-            {
-                // Handle existing client connection
-                std::map<int, ChunkedClientInfo>::iterator client_it = clients.find(fd);
-                if (client_it != clients.end() && client_it->second.is_active)
-                {
-                    size_t client_server_idx = client_it->second.server_index;
-                    // Validate server index
-                    if (client_server_idx < global_obj.size())
-                    {
-                        global_obj[client_server_idx].fd_client = fd;
-                        client_it->second.request_obj.epfd = epfd;
-                        // handle_request_chunked(fd, client_it->second, global_obj[client_server_idx]);
-                        handle_request_chunked(fd, client_it->second, global_obj,
-                                               hostport_to_indexes, client_server_idx);
-                    }
-                    else
-                    {
-                        // Clean up invalid client
-                        epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL);
-                        close(fd);
-                        clients.erase(client_it);
-                    }
-                }
-            }
+            std::cerr << "Failed to set up socket for: " << it->first << std::endl;
+            continue;
         }
-
-        cleanup_inactive_clients(epfd, clients);
+        servers.push_back(ServerInfo(socket_fd, indexes[0], backlog, it->first));
+        std::cout << "Listening on " << it->first << std::endl;
     }
+    return stopped;
+}
 
-    // Cleanup
-    close(epfd);
-    for (size_t i = 0; i < servers.size(); ++i)
+// Parse the configuration once, publish it, then start the workers. SIGHUP
+// parses it again and publishes the result for new requests.
+int main()
+{
+    // A peer that resets mid-response makes sendfile() and the CGI stdin
+    // write() raise SIGPIPE, which would kill the whole server; they get
+    // EPIPE instead. Forked workers inherit this.
+    signal(SIGPIPE, SIG_IGN);
+    GlobalConfig global;
+    ConfigSnapshot *config = new ConfigSnapshot();
+
+    if (!initialize_server_config(*config, global))
     {
-        close(servers[i].socket_fd);
+        std::cerr << "Failed to initialize server configuration." << std::endl;
+        delete config;
+        return 1;
     }
-
-    return 0;
-}
\ No newline at end of file
+    publish_config(config);
+    std::cout << "Request heads scanned with " << scan_kernel_name() << std::endl;
+    return run_workers(global);
+}
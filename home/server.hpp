@@ -18,22 +18,93 @@
 #include <sys/wait.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <pthread.h>
+#include <sys/uio.h>
 
 #define BUFFER_SIZE 12000
 #define PORT 8080
 #define MAX_EVENTS 1000
 #define CHUNK_SIZE 12000 // 300B chunks
+#define HEADER_TIMEOUT 60     // Seconds from accept to a complete header block
+#define MAX_HEADERS 64        // Header fields of one request besides the known ones, more is a 400
+#define MAX_HEAD_SIZE 16384   // Bytes of one request head, more is a 431
+#define BODY_TIMEOUT 60       // Seconds without progress while reading a body
+#define SEND_TIMEOUT 60       // Seconds without progress while sending a response
+#define CGI_TIMEOUT 10        // Seconds a CGI script may run
+#define CGI_READ_BUDGET 65536 // CGI output bytes read per wakeup
+#define CGI_WRITE_BUDGET 65536 // Request body bytes fed to a CGI script per wakeup
+#define TIMER_WHEEL_SLOTS 512 // One slot per second
+#define CONNECTION_SLAB_SIZE 64
+#define LISTEN_BACKLOG 511 // Default accept queue length, "listen 8080 backlog=N;" overrides it
+#define ACCEPT_BATCH 64    // Connections accepted per listener wakeup
+#define ACCEPT_REPORT_INTERVAL 10 // Seconds between accept queue warnings of one listener
+#define OUTPUT_SEGMENT_SIZE 16384  // Small writes are coalesced up to this size
+#define OUTPUT_FLUSH_THRESHOLD 65536 // Queued bytes that trigger a write before the wakeup ends
+#define OUTPUT_IOV_MAX 64
+#define SEND_BUDGET 262144 // Bytes one connection may send per wakeup
+#define PIPELINE_BATCH 32  // Buffered pipelined requests answered per wakeup
+#define IO_QUEUE_MAX 4096  // Jobs waiting for an I/O thread before responses are prepared inline
+#define URING_ENTRIES 1024    // Submission queue size of each worker's ring
+#define URING_BUFFERS 256     // Provided receive buffers per ring
+#define URING_BUFFER_SIZE 16384
+#define URING_FILE_CHUNK 65536 // File bytes per linked read/send pair
+#define OVERLOAD_CHECK_MS 100 // Longest wait of a shedding loop, so it notices the load is gone
+#define OVERLOAD_HOLD 1       // Seconds a worker sheds load at least once it started
 class Request;           // Forward declaration
+
+// Request methods the server tells apart, one bit each so a location's
+// allowed methods are a mask
+enum HttpMethod
+{
+    METHOD_GET = 1,
+    METHOD_POST = 2,
+    METHOD_DELETE = 4,
+    METHOD_OTHER = 8 // Any other method, answered 405
+};
+#define METHODS_ALL (METHOD_GET | METHOD_POST | METHOD_DELETE | METHOD_OTHER)
+
+// How a request is answered when that was decided while processing its
+// head, instead of by its method
+enum RequestOutcome
+{
+    OUTCOME_NONE,               // Answer according to the method
+    OUTCOME_REDIRECT,           // 302 to the location's redirection
+    OUTCOME_METHOD_NOT_ALLOWED, // 405
+    OUTCOME_TOO_LARGE           // 413, the body exceeds client_max_body_size
+};
+
 struct LocationConfig
 {
     std::string path;
-    std::vector<std::string> methods;
+    unsigned allowed_methods; // HttpMethod bits, all of them when the location has no method directive
     bool autoindex;
     std::string root;
     std::string redirection;
     std::vector<std::string> index;
     std::string upload_path;
     std::string cgi_path;
+
+    LocationConfig() : allowed_methods(0), autoindex(false) {}
+};
+
+struct GlobalConfig
+{
+    int worker_threads;   // Number of event loops, each with its own listeners
+    int worker_processes; // Pre-forked workers sharing the master's listeners
+    bool edge_triggered;  // Register sockets with EPOLLET and drain them until EAGAIN
+    ssize_t read_budget;  // Max bytes read from one connection per wakeup in EPOLLET mode
+    bool io_uring;        // Drive the workers with io_uring instead of epoll when built with it
+    int keepalive_timeout;  // Seconds an idle persistent connection is kept, 0 disables keep-alive
+    int keepalive_requests; // Requests served on one connection before it is closed
+    int io_threads;         // Threads that stat, open and list files for GET and DELETE, 0 = on the loop.
+                            // The hand-off costs more than a cached stat, so the pool is for slow disks only.
+    std::vector<int> worker_cpus; // CPU of each worker in start order, empty = workers are not pinned
+    int overload_lag;         // Loop lag in ms past which a worker sheds load, 0 = never
+    int overload_queue;       // Run-queue depth past which a worker sheds load, 0 = never
+    int overload_retry_after; // Seconds sent in Retry-After with the 503
+    GlobalConfig() : worker_threads(1), worker_processes(1), edge_triggered(false), read_budget(262144),
+                     io_uring(false), keepalive_timeout(15), keepalive_requests(100), io_threads(0),
+                     overload_lag(500), overload_queue(4096), overload_retry_after(1) {}
 };
 
 struct ServerConfig
@@ -46,12 +117,15 @@ struct ServerConfig
     std::map<int, std::string> error_pages;
     ssize_t client_max_body_size;
     std::vector<LocationConfig> locations;
+    int backlog; // Accept queue length requested from listen()
 };
 
 class Request
 {
 public:
-    std::string mthod;
+    std::string mthod; // As sent by the client
+    HttpMethod method;
+    RequestOutcome outcome;
     std::string path;
     std::string version;
     std::string root;
@@ -59,11 +133,12 @@ public:
     int listen_fd; // File descriptor for listening socket
     std::string info_body;
     std::ofstream all_body;
-    std::map<std::string, std::string> mimitype;
+    const std::map<std::string, std::string> *mimitype; // The snapshot's table, shared by every request
     std::map<std::string, std::string> post_res;
     std::vector<LocationConfig> local_data;
     std::string test_path;
     std::string uri;
+    std::string query; // After the '?' of the target, still percent-encoded
     int server_port;
     std::vector<ServerConfig> same_name_servers;
     std::string _server_name_config;
@@ -78,10 +153,10 @@ public:
     int epfd ;
     std::vector<ServerConfig> server_configs;
     int fd_client; // File descriptor for client connection
-    Request() : fd_client(-1) {}
+    Request() : method(METHOD_OTHER), outcome(OUTCOME_NONE), mimitype(NULL), fd_client(-1) {}
 
     Request(const Request &other)
-        : mthod(other.mthod), fd_client(other.fd_client), path(other.path), version(other.version),
+        : mthod(other.mthod), method(other.method), outcome(other.outcome), fd_client(other.fd_client), path(other.path), version(other.version),
           root(other.root), size1(other.size1), info_body(other.info_body),
           mimitype(other.mimitype), post_res(other.post_res),
           local_data(other.local_data), test_path(other.test_path),
@@ -95,6 +170,8 @@ public:
         if (this != &other)
         {
             mthod = other.mthod;
+            method = other.method;
+            outcome = other.outcome;
             path = other.path;
             version = other.version;
             root = other.root;
@@ -111,31 +188,422 @@ public:
         }
         return *this;
     }
+
+    // Clear the per-connection state that operator= leaves alone
+    void reset()
+    {
+        mthod.clear();
+        method = METHOD_OTHER;
+        outcome = OUTCOME_NONE;
+        path.clear();
+        version.clear();
+        info_body.clear();
+        if (all_body.is_open())
+            all_body.close();
+        all_body.clear();
+        test_path.clear();
+        uri.clear();
+        query.clear();
+        server_port = 0;
+        server_host.clear();
+        post_path.clear();
+        response_red.clear();
+        server_config = NULL;
+        content_ch = 0;
+        found_redirection = false;
+        cgj_path.clear();
+        epfd = -1;
+        fd_client = -1;
+    }
+};
+// One parsed configuration file: the server blocks with their locations
+// and error pages, the MIME table, and the listen address -> server blocks
+// index. Never modified once published. Workers and connections hold
+// references; after a reload the old snapshot is freed by its last user.
+struct ConfigSnapshot
+{
+    std::vector<Request> global_obj;
+    std::map<std::string, std::string> mime_types; // Extension -> type, from type.txt
+    std::map<std::string, std::vector<size_t> > hostport_to_indexes;
+    unsigned generation;
+    int refs;
+
+    ConfigSnapshot() : generation(0), refs(1) {}
+};
+
+struct Worker;
+struct EventHandle;
+typedef void (*EventCallback)(Worker &worker, EventHandle *handle, uint32_t events);
+
+enum HandleType
+{
+    HANDLE_LISTENER,
+    HANDLE_CLIENT,
+    HANDLE_PENDING,
+    HANDLE_CGI_PIPE,
+    HANDLE_CGI_STDIN,
+    HANDLE_IO_DONE,
+    HANDLE_WAKEUP
+};
+
+// Every fd registered with epoll carries a pointer to one of these in
+// data.ptr, so an event is dispatched with one indirect call.
+struct EventHandle
+{
+    HandleType type;
+    int fd;
+    EventCallback on_event;
+
+    EventHandle(HandleType t = HANDLE_CLIENT) : type(t), fd(-1), on_event(NULL) {}
+};
+
+// Intrusive node of a TimerWheel slot list
+struct TimerNode
+{
+    TimerNode *prev;
+    TimerNode *next;
+    time_t expires;
+    size_t slot;
+    bool linked;
+    int fd; // Connection to expire
+
+    TimerNode() : prev(NULL), next(NULL), expires(0), slot(0), linked(false), fd(-1) {}
+};
+
+// Hashed timing wheel with one-second ticks. Scheduling, cancelling and
+// expiring a timer cost O(1); finding the next deadline scans the slots,
+// never the connections.
+class TimerWheel
+{
+public:
+    TimerWheel();
+    void schedule(TimerNode &node, time_t expires);
+    void cancel(TimerNode &node);
+    void advance(time_t now, std::vector<int> &expired);
+    int next_timeout(time_t now) const;
+    size_t size() const { return count; }
+
+private:
+    std::vector<TimerNode *> slots;
+    time_t current; // Last tick already expired
+    size_t count;
 };
-class ChunkedClientInfo
+
+// Response bytes waiting for the socket. Writes are gathered with one
+// sendmsg() per flush; segments keep their buffers once drained, so a
+// pooled connection does not reallocate them.
+class OutputQueue
+{
+public:
+    OutputQueue() : head(0), used(0), offset(0), pending(0) {}
+
+    void append(const char *data, size_t size);
+    void append(const OutputQueue &other);
+    ssize_t flush(int fd); // Bytes written, -1 when the peer is gone
+    void clear();
+    bool empty() const { return pending == 0; }
+    size_t size() const { return pending; }
+
+private:
+    std::vector<std::string> segments;
+    size_t head;    // First segment not fully written
+    size_t used;    // Segments holding data
+    size_t offset;  // Bytes of segments[head] already written
+    size_t pending; // Bytes not written yet
+};
+
+enum TransferFraming
+{
+    FRAMING_LENGTH, // Content-Length body, sent with sendfile()
+    FRAMING_CHUNKED // Transfer-Encoding: chunked, framed through the output queue
+};
+
+// A connection as seen from outside the event that created it: the slot
+// generation tells a live connection from a later one reusing the fd.
+struct ClientRef
+{
+    int fd;
+    unsigned generation;
+
+    ClientRef(int f = -1, unsigned g = 0) : fd(f), generation(g) {}
+};
+
+// A static file being sent as the response body. The worker moves it
+// forward whenever the socket has room, so one large download never holds
+// the loop for longer than one send budget.
+struct FileTransfer
+{
+    int fd;
+    off_t offset; // Next byte of the file to send
+    off_t end;    // One past the last byte to send
+    TransferFraming framing;
+
+    FileTransfer() : fd(-1), offset(0), end(0), framing(FRAMING_LENGTH) {}
+    bool active() const { return fd != -1; }
+    void close()
+    {
+        if (fd != -1)
+            ::close(fd);
+        fd = -1;
+        offset = 0;
+        end = 0;
+    }
+};
+
+// The file an upload is written to. On a worker running io_uring each write
+// goes to the ring at its own offset and the request is answered once none
+// is pending (see respond()); elsewhere write() is a plain pwrite().
+struct UploadFile
+{
+    int fd;
+    off_t offset;     // Where the next write goes
+    unsigned pending; // Ring writes not completed yet
+    ClientRef owner;  // Connection the writes report back to
+
+    UploadFile() : fd(-1), offset(0), pending(0) {}
+    bool open(const char *name, const ClientRef &client);
+    bool is_open() const { return fd != -1; }
+    bool writing() const { return pending > 0; }
+    void write(const char *data, size_t size);
+    void close();
+};
+
+// With the io_uring backend the kernel receives into a provided buffer
+// before the request code runs; read_client() then serves from here.
+struct RingInput
+{
+    bool enabled;
+    const char *data; // Received bytes not consumed yet
+    size_t size;
+    int buffer;       // Provided buffer holding data, -1 when none
+    bool eof;         // Peer closed its side
+    int error;        // errno of a failed receive, 0 when none
+    bool recv_pending;
+    bool send_pending; // A poll or a file read/send chain is in flight
+
+    RingInput() : enabled(false), data(NULL), size(0), buffer(-1), eof(false), error(0),
+                  recv_pending(false), send_pending(false) {}
+};
+
+// Bytes inside a buffer owned by someone else
+struct StrView
+{
+    const char *data;
+    size_t size;
+
+    StrView() : data(NULL), size(0) {}
+    StrView(const char *d, size_t n) : data(d), size(n) {}
+    bool empty() const { return size == 0; }
+    bool equals_nocase(const char *text) const;
+    bool contains_nocase(const char *text) const;
+    std::string str() const { return std::string(data, size); }
+};
+
+// Where one element of the request head lies in the buffer it was parsed from
+struct Span
+{
+    unsigned offset;
+    unsigned length;
+
+    Span() : offset(0), length(0) {}
+};
+
+struct HeaderSpan
+{
+    Span name;
+    Span value; // Without the whitespace around it
+};
+
+// Header fields the server looks at, or that most requests carry. The
+// parser files these under their id, found with a perfect hash of the
+// name, so reading one is an array access.
+enum HeaderId
+{
+    HEADER_HOST,
+    HEADER_CONNECTION,
+    HEADER_KEEP_ALIVE,
+    HEADER_CONTENT_LENGTH,
+    HEADER_CONTENT_TYPE,
+    HEADER_TRANSFER_ENCODING,
+    HEADER_EXPECT,
+    HEADER_RANGE,
+    HEADER_IF_NONE_MATCH,
+    HEADER_IF_MODIFIED_SINCE,
+    HEADER_CACHE_CONTROL,
+    HEADER_COOKIE,
+    HEADER_AUTHORIZATION,
+    HEADER_USER_AGENT,
+    HEADER_ACCEPT,
+    HEADER_ACCEPT_ENCODING,
+    HEADER_ACCEPT_LANGUAGE,
+    HEADER_REFERER,
+    HEADER_ORIGIN,
+    HEADER_UPGRADE,
+    HEADER_OTHER // Any other name; also the number of known ones
+};
+
+// Resumable HTTP/1.x request head parser. parse() is given the buffer the
+// request is received into each time bytes were appended, and continues
+// at the byte where the previous call stopped. It records where the
+// request line parts and the header fields are, copying nothing and
+// allocating nothing; the accessors turn those spans back into views of
+// the buffer. Known fields get a slot each, the others go to a side
+// table. A repeated field keeps its last value.
+class RequestParser
+{
+public:
+    enum Status
+    {
+        PARSE_INCOMPLETE,
+        PARSE_DONE,
+        PARSE_ERROR
+    };
+
+    RequestParser() { reset(); }
+    void reset();
+    Status parse(const char *data, size_t size);
+    size_t head_size() const { return pos; } // Request line, fields and blank line, once done
+
+    StrView method(const std::string &buffer) const { return view(buffer, method_span); }
+    StrView target(const std::string &buffer) const { return view(buffer, target_span); }
+    StrView version(const std::string &buffer) const { return view(buffer, version_span); }
+    StrView header(const std::string &buffer, HeaderId id) const
+    {
+        return (known_fields & (1u << id)) ? view(buffer, known[id]) : StrView();
+    }
+    StrView header(const std::string &buffer, const char *name) const;
+    size_t other_count() const { return count; }
+    StrView other_name(const std::string &buffer, size_t i) const { return view(buffer, fields[i].name); }
+    StrView other_value(const std::string &buffer, size_t i) const { return view(buffer, fields[i].value); }
+
+private:
+    enum State
+    {
+        S_LINE_START, // Empty lines before the request line are skipped
+        S_METHOD,
+        S_TARGET_START,
+        S_TARGET,
+        S_VERSION_START,
+        S_VERSION,
+        S_LINE_END, // At the CR or LF ending the request line or a field
+        S_LINE_LF,
+        S_FIELD_START,
+        S_NAME,
+        S_VALUE_START,
+        S_VALUE,
+        S_END_LF,
+        S_DONE,
+        S_ERROR
+    };
+
+    static StrView view(const std::string &buffer, const Span &span)
+    {
+        return StrView(buffer.data() + span.offset, span.length);
+    }
+
+    State state;
+    unsigned pos;   // Next byte to look at
+    unsigned start; // First byte of the element being scanned
+    Span method_span;
+    Span target_span;
+    Span version_span;
+    HeaderId field;         // Id of the field being parsed
+    Span known[HEADER_OTHER];
+    unsigned known_fields;  // Bit per HeaderId present in known
+    HeaderSpan fields[MAX_HEADERS]; // The other fields
+    unsigned count;
+};
+
+HeaderId header_id(const char *name, size_t length);
+
+class ChunkedClientInfo;
+
+// What a connection's coroutine is suspended on in the C++20 build. The
+// reactor resumes it only for that, or when its deadline passes.
+enum TaskWait
+{
+    TASK_RUNNING,  // Not suspended
+    TASK_TURN,     // Its next turn of the run queue
+    TASK_SOCKET,   // The socket events in task_events
+    TASK_CGI,      // Output of its CGI script
+    TASK_IO_JOB    // The response an I/O thread prepares
+};
+
+// Read end of a running CGI script's stdout; the script's state lives
+// here, with the connection it answers
+struct CgiPipeHandle : public EventHandle
+{
+    ChunkedClientInfo *client;
+    pid_t pid;          // Script process, 0 once reaped
+    std::string output; // Everything the script wrote so far
+
+    CgiPipeHandle() : EventHandle(HANDLE_CGI_PIPE), client(NULL), pid(0) {}
+};
+
+// Write end of a running CGI script's stdin. The request body goes in as
+// the pipe takes it: first what is buffered, then the rest of the upload
+// file, read a piece at a time.
+struct CgiStdinHandle : public EventHandle
+{
+    ChunkedClientInfo *client;
+    std::string pending; // Body bytes the script has not taken yet
+    size_t sent;         // Of pending
+    int body_fd;         // Upload file the body continues in, -1 when none
+
+    CgiStdinHandle() : EventHandle(HANDLE_CGI_STDIN), client(NULL), sent(0), body_fd(-1) {}
+};
+
+class ChunkedClientInfo : public EventHandle
 {
 public:
     bool is_active;
     std::string cgi_headrs;
 
     time_t last_active;
-    int upload_state; // 0=reading headers, 1=reading body, 2=done
+    int upload_state; // 0=reading headers, 1=reading body, 2=done, 3=CGI, 4=response draining before the next request,
+                      // 5=response prepared by the I/O pool
     ssize_t content_length;
     ssize_t bytes_read;
     ssize_t bytes_chunked; // For chunked transfer encoding
+    ssize_t body_received; // Raw body bytes taken off the socket, framing included
     std::string transfer_encod;
     std::string partial_data;
+    std::string pipelined; // Bytes received past the current request
     std::string temp_buffer;
     int flag; // For multipart/form-data processing
-    std::string headers;
-    std::ofstream file_stream; // non-copyable
+    std::string headers; // Received bytes holding the request head, parser spans point here
+    UploadFile file_stream; // Owns its fd, never copied
     std::string filename;
     std::string boundary;
+    std::string boundary_tail; // Body bytes that may start the closing boundary, written once the next read shows
     std::string chunk_buffer;
     size_t server_index;
     Request request_obj;
-    std::map<std::string, std::string> parsed_headers;
+    RequestParser parser; // Head of the current request, parsed where it was received
     bool headers_complete;
+    bool socket_drained;  // Last read hit EAGAIN or came back short
+    ssize_t wakeup_bytes; // Bytes read since the current wakeup
+    CgiPipeHandle cgi_pipe;
+    CgiStdinHandle cgi_stdin;
+    unsigned generation; // Generation of the table slot this connection opened
+    TimerNode timer;     // Deadline of the current phase, never copied
+    int timer_phase;     // upload_state the deadline was computed for
+    time_t phase_started;
+    RingInput ring;        // Received bytes staged by the io_uring backend
+    OutputQueue output;    // Response bytes not accepted by the socket yet, never copied
+    uint32_t epoll_events; // Interest currently registered for fd
+    FileTransfer transfer; // File body still to send after output, never copied
+    size_t listen_index;   // Server block of the listener that accepted the connection
+    bool keep_alive;       // Connection stays open after the current response
+    bool io_pending;       // An I/O thread is preparing the response
+    bool scheduled;        // Queued in worker.runnable, never copied
+    void *task;            // Coroutine serving the connection in the C++20 build, never copied
+    int task_wait;         // TaskWait the coroutine is suspended on
+    uint32_t task_events;  // Socket events it waits for, then the ones that resumed it
+    bool task_expired;     // The deadline passed while it waited
+    int requests;          // Responses completed on this connection
+    int max_requests;      // Requests this connection may carry before it closes
+    ConfigSnapshot *config; // Configuration the current request runs on, one reference held
 
     // C++98 compatible default constructor
     ChunkedClientInfo()
@@ -147,6 +615,7 @@ public:
           content_length(-1),
           bytes_read(0),
           bytes_chunked(0),
+          body_received(0),
           transfer_encod(""),
           partial_data(""),
           temp_buffer(""),
@@ -154,37 +623,74 @@ public:
           headers(""),
           filename(""),
           boundary(""),
+          boundary_tail(""),
           chunk_buffer(""),
           server_index(SIZE_MAX),
           request_obj(),
-          parsed_headers(),
-          headers_complete(false)
+          parser(),
+          headers_complete(false),
+          socket_drained(false),
+          wakeup_bytes(0),
+          generation(0),
+          timer_phase(-1),
+          phase_started(0),
+          epoll_events(0),
+          listen_index(SIZE_MAX),
+          keep_alive(false),
+          io_pending(false),
+          scheduled(false),
+          task(NULL),
+          task_wait(TASK_RUNNING),
+          task_events(0),
+          task_expired(false),
+          requests(0),
+          max_requests(1),
+          config(NULL)
     {
     }
 
     // Copy constructor
     ChunkedClientInfo(const ChunkedClientInfo &other)
-        : is_active(other.is_active),
+        : EventHandle(other),
+          is_active(other.is_active),
           last_active(other.last_active),
           upload_state(other.upload_state),
           content_length(other.content_length),
           bytes_read(other.bytes_read),
           bytes_chunked(other.bytes_chunked),
+          body_received(other.body_received),
           transfer_encod(other.transfer_encod),
           partial_data(other.partial_data),
+          pipelined(other.pipelined),
           cgi_headrs(other.cgi_headrs),
           temp_buffer(other.temp_buffer),
           flag(other.flag),
           headers(other.headers),
           filename(other.filename),
           boundary(other.boundary),
+          boundary_tail(other.boundary_tail),
           chunk_buffer(other.chunk_buffer),
           server_index(other.server_index),
           request_obj(other.request_obj),
-          parsed_headers(other.parsed_headers),
-          headers_complete(other.headers_complete)
+          parser(other.parser),
+          headers_complete(other.headers_complete),
+          socket_drained(other.socket_drained),
+          wakeup_bytes(other.wakeup_bytes),
+          timer_phase(other.timer_phase),
+          phase_started(other.phase_started),
+          listen_index(other.listen_index),
+          keep_alive(other.keep_alive),
+          io_pending(other.io_pending),
+          scheduled(false),
+          task(NULL),
+          task_wait(TASK_RUNNING),
+          task_events(0),
+          task_expired(false),
+          requests(other.requests),
+          max_requests(other.max_requests),
+          config(other.config)
     {
-        // file_stream is not copyable, so we don't copy it
+        // file_stream owns its fd, so it is not copied
     }
 
     // Assignment operator
@@ -198,27 +704,285 @@ public:
             content_length = other.content_length;
             bytes_read = other.bytes_read;
             bytes_chunked = other.bytes_chunked;
+            body_received = other.body_received;
             transfer_encod = other.transfer_encod;
             partial_data = other.partial_data;
+            pipelined = other.pipelined;
             temp_buffer = other.temp_buffer;
             flag = other.flag;
             headers = other.headers;
             // file_stream is not assigned
             filename = other.filename;
             boundary = other.boundary;
+            boundary_tail = other.boundary_tail;
             chunk_buffer = other.chunk_buffer;
             server_index = other.server_index;
             request_obj = other.request_obj;
-            parsed_headers = other.parsed_headers;
+            parser = other.parser;
             headers_complete = other.headers_complete;
+            socket_drained = other.socket_drained;
+            wakeup_bytes = other.wakeup_bytes;
+            timer_phase = other.timer_phase;
+            phase_started = other.phase_started;
+            listen_index = other.listen_index;
+            keep_alive = other.keep_alive;
+            io_pending = other.io_pending;
+            requests = other.requests;
+            max_requests = other.max_requests;
+            config = other.config;
         }
         return *this;
     }
+
+    // Forget the current request so the connection can read the next one.
+    // Strings are cleared, not freed, so their buffers are reused.
+    void reset_request()
+    {
+        cgi_headrs.clear();
+        upload_state = 0;
+        content_length = -1;
+        bytes_read = 0;
+        bytes_chunked = 0;
+        body_received = 0;
+        transfer_encod.clear();
+        partial_data.clear();
+        temp_buffer.clear();
+        flag = 0;
+        headers.clear();
+        if (file_stream.is_open())
+            file_stream.close();
+        filename.clear();
+        boundary.clear();
+        boundary_tail.clear();
+        chunk_buffer.clear();
+        request_obj.reset();
+        parser.reset();
+        headers_complete = false;
+        keep_alive = false;
+        io_pending = false;
+    }
+
+    // Back to the default-constructed state for the next connection
+    void reset()
+    {
+        reset_request();
+        pipelined.clear();
+        fd = -1;
+        is_active = true;
+        last_active = 0;
+        server_index = SIZE_MAX;
+        socket_drained = false;
+        wakeup_bytes = 0;
+        cgi_pipe.fd = -1;
+        cgi_pipe.pid = 0;
+        cgi_pipe.output.clear();
+        cgi_stdin.fd = -1;
+        cgi_stdin.body_fd = -1;
+        cgi_stdin.pending.clear();
+        cgi_stdin.sent = 0;
+        scheduled = false;
+        task = NULL;
+        task_wait = TASK_RUNNING;
+        task_events = 0;
+        task_expired = false;
+        timer.fd = -1;
+        timer_phase = -1;
+        phase_started = 0;
+        ring = RingInput();
+        file_stream = UploadFile();
+        output.clear();
+        transfer.close();
+        epoll_events = 0;
+        listen_index = SIZE_MAX;
+        requests = 0;
+        max_requests = 1;
+        config = NULL;
+    }
+};
+
+// A connection accepted with nothing received yet. Idle sockets (health
+// checks, browser pre-connects) stay in this small record; the full
+// ChunkedClientInfo is only opened once their first bytes arrive.
+struct PendingClient : public EventHandle
+{
+    size_t listen_index;    // Server block of the listener that accepted it
+    time_t accepted;
+    unsigned generation;    // Generation of the table slot it opened
+    TimerNode timer;        // Header deadline, counted from accept
+    ConfigSnapshot *config; // Configuration it was accepted on, one reference held
+
+    PendingClient() : EventHandle(HANDLE_PENDING), listen_index(SIZE_MAX), accepted(0), generation(0), config(NULL) {}
+
+    void reset()
+    {
+        fd = -1;
+        listen_index = SIZE_MAX;
+        accepted = 0;
+        timer.fd = -1;
+        config = NULL;
+    }
+};
+
+// Slab allocator for connection objects. Objects are carved out of slabs
+// of CONNECTION_SLAB_SIZE and recycled through a free list, so connection
+// churn does not go through malloc/free once the pool is warm.
+template <class T>
+class SlabPool
+{
+public:
+    SlabPool();
+    SlabPool(const SlabPool &other);
+    SlabPool &operator=(const SlabPool &other);
+    ~SlabPool();
+
+    T *acquire();
+    void release(T *object);
+    void reserve(size_t count);
+    const void *slab(size_t index) const { return slabs[index]; }
+    size_t allocated() const { return slabs.size() * CONNECTION_SLAB_SIZE; }
+    size_t available() const { return free_list.size(); }
+
+private:
+    std::vector<T *> slabs;
+    std::vector<T *> free_list;
+};
+
+typedef SlabPool<ChunkedClientInfo> ConnectionPool;
+typedef SlabPool<PendingClient> PendingPool;
+
+// Accept counters of one listener in one worker
+struct AcceptStats
+{
+    unsigned long accepted;
+    unsigned long capped;     // Wakeups that stopped at ACCEPT_BATCH
+    unsigned long queue_full; // Capped wakeups that found the accept queue full
+    unsigned queue_peak;      // Longest accept queue seen, from TCP_INFO
+    bool busy;                // Last wakeup drained a full backlog or batch
+    time_t last_report;
+
+    AcceptStats() : accepted(0), capped(0), queue_full(0), queue_peak(0), busy(false), last_report(0) {}
+};
+
+struct ServerInfo : public EventHandle
+{
+    int socket_fd; // -1 once a reload removed the address
+    size_t config_index;
+    int backlog;
+    std::string address; // host:port key in hostport_to_indexes
+    AcceptStats stats;
+
+    ServerInfo() : EventHandle(HANDLE_LISTENER), socket_fd(-1), config_index(0), backlog(LISTEN_BACKLOG) {}
+    ServerInfo(int fd, size_t idx, int queue = LISTEN_BACKLOG, const std::string &addr = "")
+        : EventHandle(HANDLE_LISTENER), socket_fd(fd), config_index(idx), backlog(queue), address(addr)
+    {
+        this->fd = fd;
+    }
+};
+
+struct ClientSlot
+{
+    ChunkedClientInfo *client; // Borrowed from the table's pool while in use
+    PendingClient *pending;    // Set instead of client until the first bytes arrive
+    unsigned generation;       // Bumped every time the slot is released
+    bool in_use;
+
+    ClientSlot() : client(NULL), pending(NULL), generation(0), in_use(false) {}
+};
+
+// Connection table indexed by fd. fds are small dense integers, so lookup
+// is an array index. Connection objects come from a ConnectionPool, so
+// accept and close do not allocate once the table has warmed up. A slot
+// starts with a PendingClient when the connection is accepted before any
+// data, and trades it for the full object in promote().
+class ClientTable
+{
+public:
+    ClientTable();
+    ClientTable(const ClientTable &other);
+    ClientTable &operator=(const ClientTable &other);
+    ~ClientTable();
+
+    ChunkedClientInfo *open(int fd);
+    PendingClient *open_pending(int fd);
+    ChunkedClientInfo *promote(int fd);
+    ChunkedClientInfo *find(int fd) const;
+    ChunkedClientInfo *find(const ClientRef &ref) const;
+    PendingClient *find_pending(int fd) const;
+    PendingClient *find_pending(const ClientRef &ref) const;
+    void release(int fd);
+    void reserve(size_t connections) { pool.reserve(connections); }
+    const ConnectionPool &connections() const { return pool; }
+    size_t capacity() const { return slots.size(); }
+    size_t size() const { return active; }
+
+private:
+    ClientSlot *claim(int fd);
+
+    std::vector<ClientSlot> slots;
+    size_t active; // Slots in use, pending ones included
+    ConnectionPool pool;
+    PendingPool pending_pool;
+};
+
+struct UringBackend;
+struct IoJob;
+
+// How far one worker's loop is behind, and whether it sheds load: its
+// listeners are paused and new requests get the prebuilt 503
+struct OverloadState
+{
+    long lag_us;          // Smoothed time the last event of a batch waited to be handled
+    size_t queued;        // Clients waiting for another turn when the last batch started
+    bool shedding;
+    time_t since;         // When shedding started
+    unsigned long shed;   // Requests answered 503 since then
+    std::string response; // 503 with Retry-After, built once per worker
+
+    OverloadState() : lag_us(0), queued(0), shedding(false), since(0), shed(0) {}
+};
+
+// One event loop: its own epoll instance, listeners and client table
+struct Worker
+{
+    int id;
+    int epfd;
+    pthread_t thread;
+    int cpu; // CPU the loop is pinned to, -1 when it is not
+    std::vector<ServerInfo> servers;
+    ConfigSnapshot *config;   // Configuration new connections start on, one reference held
+    const GlobalConfig *global;
+    ClientTable clients;
+    TimerWheel timers;
+    std::vector<ClientRef> closing; // Clients to close once the current batch is done
+    std::vector<ClientRef> runnable; // Clients with work left for the next round, see schedule_client()
+    time_t now;               // Cached once per loop iteration
+    UringBackend *ring;       // Set while the worker runs on io_uring
+    EventHandle io_done;      // eventfd the I/O pool signals when a job finished
+    pthread_mutex_t io_lock;  // Guards io_finished, set up with io_done
+    std::vector<IoJob *> io_finished;
+    EventHandle wakeup;       // eventfd written when another thread published a configuration
+    bool draining;            // Listeners closed, exiting once the last connection is gone
+    OverloadState overload;
+
+    Worker() : id(0), epfd(-1), thread(), cpu(-1), config(NULL), global(NULL), now(0), ring(NULL),
+               io_done(HANDLE_IO_DONE), wakeup(HANDLE_WAKEUP), draining(false) {}
+};
+
+// A GET or DELETE response prepared on an I/O thread. The thread works on
+// a record of its own holding only the request context the response needs,
+// so the worker only has to move the queued output and the opened file
+// into the live connection.
+struct IoJob
+{
+    Worker *worker;
+    ClientRef ref;
+    ChunkedClientInfo client;
 };
 void process_multipart_data(ChunkedClientInfo &client, const std::string &data);
-void parsing_method(Request &rec, const std::string &line);
+void parsing_method(Request &rec, const StrView &method, const StrView &target, const StrView &version);
+HttpMethod method_from_name(const char *name, size_t length);
 void handle_directory_request(const std::string &path, const std::string &uri, int &fd, Request &obj, const std::string &type);
-void parsing_Get(std::map<std::string, std::string> head, std::string path, int &fd, std::string type, std::string uri, Request &obj);
+void parsing_Get(const std::string &range, std::string path, int &fd, std::string type, std::string uri, Request &obj);
 void ft_error(const char *msg);
 void response(std::string name_file, int fd, std::string header);
 long getFileSize(const std::string &filename);
@@ -226,12 +990,11 @@ bool hasEnding(const std::string &fullString, const std::string &ending);
 std::string getContentType(const std::string &filename);
 bool is_file(const std::string &path);
 bool is_directory(const std::string &path);
-std::string remove_slash(std::string path);
-std::string urlDecode(const std::string &str);
+void canonicalize_target(const StrView &target, std::string &path, std::string &query);
 std::string Format_urlencoded(std::string path, std::map<std::string, std::string> &post_res,
                               std::map<std::string, std::string> &form_data, Request &obj);
 void all_type(std::map<std::string, std::string> &mimitype);
-std::vector<ServerConfig> check_configfile();
+std::vector<ServerConfig> check_configfile(GlobalConfig &global);
 void serve_not_found(int &fd);
 void response_post(std::string name_file, int fd, std::string header);
 std::string handle_authentication(const std::string &path, const std::string &username,
@@ -240,32 +1003,60 @@ std::string remove_first_slash(const std::string &path);
 bool parseRangeHeader(const std::string &rangeHeader, long fileSize, long &start, long &end);
 bool sendDataReliably(int fd, const char *data, size_t size);
 void sendChunk(int fd, const char *data, size_t size);
-void response_plus(std::string name_file, int fd, std::string header, std::map<std::string, std::string> &headers);
+bool queue_send(int fd, const char *data, size_t size);
+std::string connection_header(int fd);
+ssize_t write_client(ChunkedClientInfo &client, size_t budget);
+bool queue_transfer(ChunkedClientInfo &client, size_t limit);
+void response_plus(std::string name_file, int fd, std::string header, const std::string &range);
 void make_nonblocking(int fd);
 int create_socket();
 void setup_server_address(sockaddr_in &serv_add, int port);
-void bind_and_listen(int socket_fd, sockaddr_in &serv_add);
-int setup_server_socket(Request &global_obj);
+bool bind_and_listen(int socket_fd, sockaddr_in &serv_add, Request &global_obj, int backlog);
+int setup_server_socket(Request &global_obj, int backlog);
 int accept_client(int socket_fd);
 std::string normalize_path(const std::string &path);
 std::string remove_last_path_component(std::string path);
-void parse_headers(std::istringstream &stream, std::map<std::string, std::string> &headers);
+StrView request_header(const ChunkedClientInfo &client, HeaderId id);
+size_t scan_line_end(const char *data, size_t size);
+size_t scan_target_end(const char *data, size_t size);
+size_t scan_path_special(const char *data, size_t size);
+const char *scan_kernel_name();
 bool parse_method_line(ChunkedClientInfo &client);
-void extract_content_length(ChunkedClientInfo &client);
-bool check_headers_complete(ChunkedClientInfo &client);
+bool extract_content_length(ChunkedClientInfo &client);
+void split_pipelined_input(ChunkedClientInfo &client);
 // bool read_headers_chunked(int fd, ChunkedClientInfo &client);
 std::string extract_boundary(const std::string &content_type);
 bool process_multipart_request(ChunkedClientInfo &client, const std::string &content_type);
 bool process_urlencoded_request(ChunkedClientInfo &client);
 int accept_new_client(int socket_fd);
+bool add_client_to_epoll(Worker &worker, int client_fd, const Request &global_obj, size_t server_index);
 // bool add_client_to_epoll(int epfd, int client_fd, std::map<int, ChunkedClientInfo> &clients,
 //                          const Request &global_obj);
 // void handle_new_connections(int socket_fd, int epfd, std::map<int, ChunkedClientInfo> &clients,
 //                              const Request &global_obj);
-bool should_cleanup_client(const ChunkedClientInfo &client);
 void cleanup_client(int fd, ChunkedClientInfo &client);
-void cleanup_inactive_clients(int epfd, std::map<int, ChunkedClientInfo> &clients);
-int setup_epoll(int socket_fd);
+void close_client(Worker &worker, const ClientRef &ref);
+void update_client_timer(Worker &worker, ChunkedClientInfo &client);
+ChunkedClientInfo *find_current_client(int fd);
+Worker *running_worker();
+void finish_upload(Worker &worker, ChunkedClientInfo &client);
+void close_finished_clients(Worker &worker);
+void run_queued_clients(Worker &worker);
+bool start_io_pool(int threads);
+bool setup_io_completions(Worker &worker);
+bool submit_io_job(Worker &worker, ChunkedClientInfo &client);
+void return_response_context(ChunkedClientInfo &client, IoJob &job);
+ChunkedClientInfo *find_io_client(int fd);
+bool on_io_thread();
+void respond(int fd, ChunkedClientInfo &client);
+bool run_uring_event_loop(Worker &worker);
+void uring_write_client(Worker &worker, ChunkedClientInfo &client);
+void uring_arm_client(Worker &worker, ChunkedClientInfo &client);
+void uring_close_client(Worker &worker, ChunkedClientInfo &client);
+void uring_write_upload(Worker &worker, UploadFile &file, const char *data, size_t size);
+void uring_close_upload(Worker &worker, int fd);
+bool uring_watch_listener(Worker &worker, size_t index);
+void uring_unwatch_listener(Worker &worker, size_t index);
 bool initialize_server_config(std::vector<Request> &global_obj);
 std::string extract_filename(const std::string &data);
 bool open_file_for_writing(ChunkedClientInfo &client, const std::string &filename);
@@ -279,13 +1070,28 @@ void send_response(int fd, ChunkedClientInfo &client);
 // void handle_request_chunked(int fd, ChunkedClientInfo &client, Request &global_obj);
 bool process_request_headers(ChunkedClientInfo &client);
 bool read_body_chunk(int fd, ChunkedClientInfo &client);
+void accept_request_head(int fd, ChunkedClientInfo &client);
+ssize_t read_client(int fd, char *buffer, size_t size, ChunkedClientInfo &client);
+bool wants_keep_alive(const ChunkedClientInfo &client);
+bool response_keeps_alive(const ChunkedClientInfo &client);
+void finish_request(ChunkedClientInfo &client);
 bool process_post_request(ChunkedClientInfo &client);
 void response(std::string name_file, int fd, std::string header);
 void chunked_transfer_encoding(ChunkedClientInfo &client, std::string &data);
-void handle_new_connections(int socket_fd, int epfd, std::map<int, ChunkedClientInfo> &clients,
-                            const Request &global_obj, size_t server_index);
-bool initialize_server_config(std::vector<Request> &global_obj,
-                              std::map<std::string, std::vector<size_t> > &hostport_to_indexes);
+bool handle_new_connections(Worker &worker, ServerInfo &server);
+bool initialize_server_config(ConfigSnapshot &config, GlobalConfig &global);
+std::string listen_address(const ServerConfig &server);
+std::vector<size_t> sync_listeners(std::vector<ServerInfo> &servers, ConfigSnapshot &config);
+ConfigSnapshot *acquire_config();
+void retain_config(ConfigSnapshot *config);
+void release_config(ConfigSnapshot *config);
+unsigned publish_config(ConfigSnapshot *config);
+unsigned current_config_generation();
+void install_reload_handler();
+bool take_reload_request();
+bool reload_config();
+void watch_config(int wakeup_fd);
+void unwatch_config(int wakeup_fd);
 void handle_request_chunked(int fd, ChunkedClientInfo &client, std::vector<Request> &global_obj,
                             std::map<std::string, std::vector<size_t> > &hostport_to_indexes,
                             size_t client_server_idx);
@@ -294,5 +1100,44 @@ bool read_headers_chunked(int fd,
                           std::vector<Request> &global_obj,
                           const std::map<std::string, std::vector<size_t> > &hostport_to_indexes, size_t client_server_idx);
 void sendErrorResponse(int fd, int error_code, const std::string &error_message, std::string path_file);
-void handle_cgi_request(ChunkedClientInfo &client, int new_socket, std::map<std::string, std::string> &headers);
-bool is_cgi_request(const std::string &path);
\ No newline at end of file
+void handle_cgi_request(ChunkedClientInfo &client, int new_socket);
+bool read_cgi_output(ChunkedClientInfo &client);
+bool write_cgi_input(ChunkedClientInfo &client);
+void stop_cgi_input(ChunkedClientInfo &client);
+void finish_cgi_request(ChunkedClientInfo &client, int new_socket);
+void cgi_timed_out(ChunkedClientInfo &client, int new_socket);
+void stop_cgi(ChunkedClientInfo &client);
+bool is_cgi_request(const std::string &path);
+void setup_all_sockets(std::vector<ServerInfo> &servers, std::vector<Request> &global_obj,
+                       std::map<std::string, std::vector<size_t> > &hostport_to_indexes,
+                       std::map<int, size_t> &socket_fd_to_default_index);
+bool setup_worker(Worker &worker);
+bool register_listeners(Worker &worker);
+void close_worker(Worker &worker);
+void on_client_event(Worker &worker, EventHandle *handle, uint32_t events);
+void on_cgi_pipe_event(Worker &worker, EventHandle *handle, uint32_t events);
+void on_cgi_stdin_event(Worker &worker, EventHandle *handle, uint32_t events);
+void run_event_loop(Worker &worker);
+bool check_worker(Worker &worker);
+std::vector<int> allowed_cpus();
+void place_worker(Worker &worker);
+void release_cpu_affinity();
+bool start_connection_task(Worker &worker, ChunkedClientInfo &client);
+bool wake_connection_task(ChunkedClientInfo &client, TaskWait what, uint32_t events);
+bool expire_connection_task(ChunkedClientInfo &client);
+void destroy_connection_task(ChunkedClientInfo &client);
+bool begin_client_turn(Worker &worker, ChunkedClientInfo &client);
+bool run_client(Worker &worker, int fd, ChunkedClientInfo &client, size_t client_server_idx);
+void dispatch_response(Worker &worker, ChunkedClientInfo &client);
+void fail_client(ChunkedClientInfo &client);
+bool send_client_output(Worker &worker, ChunkedClientInfo &client, bool &budget_spent);
+bool start_next_request(Worker &worker, ChunkedClientInfo &client);
+bool start_pipelined_request(Worker &worker, ChunkedClientInfo &client);
+void schedule_client(Worker &worker, ChunkedClientInfo &client);
+void setup_overload(Worker &worker);
+void update_overload(Worker &worker, const struct timespec &woke, size_t queued);
+int overload_timeout(const Worker &worker, int timeout);
+const std::string *overload_response();
+void pause_listeners(Worker &worker);
+void resume_listeners(Worker &worker);
+int run_workers(const GlobalConfig &global);
@@ -16,7 +16,7 @@ void make_nonblocking(int fd)
 
 int create_socket()
 {
-    int socket_fd = socket(AF_INET, SOCK_STREAM, 0);
+    int socket_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
     if (socket_fd < 0)
     {
         perror("Socket creation failed");
@@ -28,13 +28,22 @@ int create_socket()
     if (setsockopt(socket_fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0)
     {
         perror("setsockopt failed");
+        close(socket_fd);
         return -1;
     }
-
-    make_nonblocking(socket_fd);
     return socket_fd;
 }
 
+// listen() silently truncates the backlog to net.core.somaxconn
+static int read_somaxconn()
+{
+    std::ifstream file("/proc/sys/net/core/somaxconn");
+    int value = 0;
+    if (!(file >> value))
+        return -1;
+    return value;
+}
+
 bool setup_server_address(struct sockaddr_in &serv_addr, const std::string &ip, int port)
 {
     struct addrinfo hints, *res = NULL;
@@ -61,23 +70,34 @@ bool setup_server_address(struct sockaddr_in &serv_addr, const std::string &ip,
     return true;
 }
 
-void bind_and_listen(int socket_fd, sockaddr_in &serv_add, Request &global_obj)
+bool bind_and_listen(int socket_fd, sockaddr_in &serv_add, Request &global_obj, int backlog)
 {
     if (bind(socket_fd, (struct sockaddr *)&serv_add, sizeof(serv_add)) < 0)
     {
         std::cerr << "[ERROR] Could not bind to " << global_obj.server.host << ":" << global_obj.server.port
                   << " — " << strerror(errno) << std::endl;
-        return;
+        return false;
     }
 
-    if (listen(socket_fd, 5) < 0)
+    if (listen(socket_fd, backlog) < 0)
     {
         std::cerr << "[ERROR] Could not listen on " << global_obj.server.host << ":" << global_obj.server.port
                   << " — " << strerror(errno) << std::endl;
+        return false;
     }
+
+    static bool warned = false;
+    int somaxconn = read_somaxconn();
+    if (somaxconn > 0 && backlog > somaxconn && !warned)
+    {
+        std::cerr << "[WARN] backlog " << backlog << " on " << global_obj.server.host << ":"
+                  << global_obj.server.port << " is capped by net.core.somaxconn=" << somaxconn << std::endl;
+        warned = true;
+    }
+    return true;
 }
 
-int setup_server_socket(Request &global_obj)
+int setup_server_socket(Request &global_obj, int backlog)
 {
     sockaddr_in serv_add;
 
@@ -97,46 +117,57 @@ int setup_server_socket(Request &global_obj)
         std::cerr << "Failed to create socket for " << host << ":" << global_obj.server.port << std::endl;
         return -1; // socket creation failed
     }
-    bind_and_listen(socket_fd, serv_add, global_obj);
-
+    if (!bind_and_listen(socket_fd, serv_add, global_obj, backlog))
+    {
+        close(socket_fd);
+        return -1;
+    }
     return socket_fd;
 }
 
+// The new socket comes back non-blocking and close-on-exec in one call
 int accept_client(int socket_fd)
 {
-    sockaddr_in cli_add;
-    socklen_t cli_len = sizeof(cli_add);
-    int new_socket = accept(socket_fd, (struct sockaddr *)&cli_add, &cli_len);
-    if (new_socket < 0)
+    int new_socket = accept4(socket_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (new_socket < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != ECONNABORTED)
     {
         perror("Accept failed");
     }
     return new_socket;
 }
-// Initialize server configuration
-bool initialize_server_config(std::vector<Request> &global_obj,
-                              std::map<std::string, std::vector<size_t> > &hostport_to_indexes)
+// host:port key of the server block's listen address
+std::string listen_address(const ServerConfig &server)
+{
+    std::ostringstream oss;
+    oss << server.host << ":" << server.port;
+    return oss.str();
+}
+
+// Parse the configuration file into config. Directives of the global
+// section go to global.
+bool initialize_server_config(ConfigSnapshot &config, GlobalConfig &global)
 {
-    std::vector<ServerConfig> all_servers = check_configfile();
+    std::vector<ServerConfig> all_servers = check_configfile(global);
     if (all_servers.empty())
     {
         std::cerr << "Error: No server configurations found" << std::endl;
         return false;
     }
 
+    std::vector<Request> &global_obj = config.global_obj;
     global_obj.resize(all_servers.size());
+    all_type(config.mime_types);
 
     for (size_t i = 0; i < all_servers.size(); ++i)
     {
-        all_type(global_obj[i].mimitype);
+        global_obj[i].mimitype = &config.mime_types;
         global_obj[i].server = all_servers[i];
         global_obj[i].local_data = all_servers[i].locations;
         global_obj[i].root = all_servers[i].root;
 
-        std::ostringstream oss;
-        oss << all_servers[i].host << ":" << all_servers[i].port;
-        hostport_to_indexes[oss.str()].push_back(i);
-        std::cout << "=======> " << oss.str() << std::endl;
+        std::string address = listen_address(all_servers[i]);
+        config.hostport_to_indexes[address].push_back(i);
+        std::cout << "=======> " << address << std::endl;
     }
     return true;
 }
\ No newline at end of file
@@ -0,0 +1,90 @@
+#include "server.hpp"
+
+TimerWheel::TimerWheel() : slots(TIMER_WHEEL_SLOTS, static_cast<TimerNode *>(NULL)), current(0), count(0)
+{
+}
+
+// Link the node into the slot of its expiry second. Deadlines already in
+// the past fire on the next tick.
+void TimerWheel::schedule(TimerNode &node, time_t expires)
+{
+    if (node.linked)
+        cancel(node);
+    if (current != 0 && expires <= current)
+        expires = current + 1;
+
+    node.expires = expires;
+    node.slot = static_cast<size_t>(expires) % slots.size();
+    node.prev = NULL;
+    node.next = slots[node.slot];
+    if (node.next)
+        node.next->prev = &node;
+    slots[node.slot] = &node;
+    node.linked = true;
+    count++;
+}
+
+void TimerWheel::cancel(TimerNode &node)
+{
+    if (!node.linked)
+        return;
+    if (node.prev)
+        node.prev->next = node.next;
+    else
+        slots[node.slot] = node.next;
+    if (node.next)
+        node.next->prev = node.prev;
+    node.prev = NULL;
+    node.next = NULL;
+    node.linked = false;
+    count--;
+}
+
+// Expire every timer due at or before now and return their fds. Only the
+// slots for the seconds that passed are visited; timers that hash into the
+// same slot but belong to a later revolution stay linked.
+void TimerWheel::advance(time_t now, std::vector<int> &expired)
+{
+    if (current == 0 || now < current)
+        current = now - 1;
+
+    time_t ticks = now - current;
+    if (ticks > static_cast<time_t>(slots.size()))
+        ticks = slots.size();
+
+    for (time_t t = 1; t <= ticks && count > 0; ++t)
+    {
+        size_t slot = static_cast<size_t>(now - ticks + t) % slots.size();
+        TimerNode *node = slots[slot];
+        while (node)
+        {
+            TimerNode *next = node->next;
+            if (node->expires <= now)
+            {
+                cancel(*node);
+                expired.push_back(node->fd);
+            }
+            node = next;
+        }
+    }
+    current = now;
+}
+
+// Milliseconds until the first non-empty slot, for epoll_wait. -1 when no
+// timer is scheduled. Waking up early for a later revolution is harmless.
+int TimerWheel::next_timeout(time_t now) const
+{
+    if (count == 0)
+        return -1;
+
+    time_t base = (current != 0) ? current : now;
+    for (size_t t = 1; t <= slots.size(); ++t)
+    {
+        if (slots[static_cast<size_t>(base + t) % slots.size()])
+        {
+            time_t wait = base + t - now;
+            return (wait > 0) ? static_cast<int>(wait * 1000) : 0;
+        }
+    }
+    return 0;
+}
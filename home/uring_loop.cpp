@@ -0,0 +1,1010 @@
+#include "server.hpp"
+
+#ifdef WEBSERV_IO_URING
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <poll.h>
+#include <algorithm>
+
+// io_uring backend, driven through the raw syscalls. Listeners use one
+// multishot accept each (one accept per request on kernels before 5.19,
+// which reject multishot), clients receive into a group of provided buffers,
+// and file bodies go out as a linked read -> send pair per chunk, so the
+// worker neither polls for readiness nor blocks on disk reads. Everything
+// still registered with epoll (CGI pipes) is reached through one poll
+// request on the epoll fd.
+
+#define URING_BUFFER_GROUP 1
+
+enum UringOpType
+{
+    URING_ACCEPT,
+    URING_RECV,
+    URING_POLLOUT,
+    URING_FILE, // Linked read + send of one file chunk
+    URING_EPOLL,
+    URING_CANCEL, // Cancellation of a stopped listener's accept
+    URING_WRITE   // Upload data written to its file
+};
+
+// One request in flight. user_data points here; the read half of a file
+// chunk is tagged with the low bit.
+struct UringOp
+{
+    UringOpType type;
+    ClientRef ref;     // Client the request belongs to
+    size_t server;     // Listener index for URING_ACCEPT
+    bool multishot;    // URING_ACCEPT submitted with IORING_ACCEPT_MULTISHOT
+    int file_fd;       // File read by URING_FILE, written by URING_WRITE
+    int pending;       // Completions still expected
+    std::vector<char> buffer;
+    size_t length;     // Bytes of buffer to send
+    size_t sent;       // Bytes of buffer already sent
+    size_t file_bytes; // File bytes carried by buffer
+    ssize_t read_result;
+    ssize_t send_result;
+
+    UringOp() : type(URING_RECV), server(0), multishot(false), file_fd(-1), pending(0), length(0), sent(0),
+                file_bytes(0), read_result(0), send_result(0) {}
+};
+
+struct UringBackend
+{
+    int fd;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned sq_entries;
+    struct io_uring_sqe *sqes;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring;
+    size_t cq_ring_size;
+    size_t sqes_size;
+    unsigned queued; // SQEs written since the last io_uring_enter()
+    bool multishot_accept; // Cleared when the kernel turns multishot accept down
+    unsigned skip_success; // IOSQE_CQE_SKIP_SUCCESS when the kernel has it (5.17), else 0
+    size_t writes;         // Upload writes in flight
+
+    std::vector<char> buffers;        // URING_BUFFERS provided receive buffers
+    std::vector<UringOp *> free_ops;
+    std::vector<unsigned> inflight;   // Requests using each fd
+    std::vector<bool> close_pending;  // fd to close once its requests completed
+    std::vector<ClientRef> starved;   // Receives that found no free buffer
+    std::vector<ClientRef> ready;     // Clients with received bytes left over
+    std::vector<UringOp *> accepts;   // Multishot accept of each listener, NULL when stopped
+    UringOp epoll_op;
+    UringOp cancel_op;
+
+    UringBackend() : fd(-1), sq_head(NULL), sq_tail(NULL), sq_mask(NULL), sq_array(NULL), sq_entries(0),
+                     sqes(NULL), cq_head(NULL), cq_tail(NULL), cq_mask(NULL), cqes(NULL), sq_ring(NULL),
+                     sq_ring_size(0), cq_ring(NULL), cq_ring_size(0), sqes_size(0), queued(0),
+                     multishot_accept(true), skip_success(0), writes(0) {}
+};
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *params)
+{
+    return syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags,
+                              void *arg, size_t arg_size)
+{
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, arg_size);
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args)
+{
+    return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+// Whether the kernel knows every opcode the backend submits
+static bool has_required_ops(int fd)
+{
+    static const unsigned char required[] = {IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_SEND,
+                                             IORING_OP_READ, IORING_OP_POLL_ADD, IORING_OP_ASYNC_CANCEL,
+                                             IORING_OP_PROVIDE_BUFFERS, IORING_OP_WRITE};
+    std::vector<char> storage(sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op), 0);
+    struct io_uring_probe *probe = reinterpret_cast<struct io_uring_probe *>(&storage[0]);
+    if (sys_io_uring_register(fd, IORING_REGISTER_PROBE, probe, 256) < 0)
+        return false;
+    for (size_t i = 0; i < sizeof(required); ++i)
+    {
+        if (required[i] >= probe->ops_len || !(probe->ops[required[i]].flags & IO_URING_OP_SUPPORTED))
+            return false;
+    }
+    return true;
+}
+
+static bool setup_ring(UringBackend &ring)
+{
+    struct io_uring_params params;
+    std::memset(&params, 0, sizeof(params));
+    ring.fd = sys_io_uring_setup(URING_ENTRIES, &params);
+    if (ring.fd < 0)
+    {
+        perror("io_uring_setup");
+        return false;
+    }
+    // The loop waits with a timeout passed to io_uring_enter(), and relies
+    // on completions never being dropped
+    if (!(params.features & IORING_FEAT_EXT_ARG) || !(params.features & IORING_FEAT_NODROP) ||
+        !(params.features & IORING_FEAT_SINGLE_MMAP) || !has_required_ops(ring.fd))
+    {
+        std::cerr << "io_uring: kernel lacks the required features" << std::endl;
+        close(ring.fd);
+        ring.fd = -1;
+        return false;
+    }
+
+    ring.sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring.cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    // With IORING_FEAT_SINGLE_MMAP both rings share one mapping
+    ring.sq_ring_size = std::max(ring.sq_ring_size, ring.cq_ring_size);
+    ring.sq_ring = mmap(NULL, ring.sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                        ring.fd, IORING_OFF_SQ_RING);
+    ring.sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    void *sqes = mmap(NULL, ring.sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring.fd, IORING_OFF_SQES);
+    if (ring.sq_ring == MAP_FAILED || sqes == MAP_FAILED)
+    {
+        perror("io_uring mmap");
+        if (ring.sq_ring != MAP_FAILED)
+            munmap(ring.sq_ring, ring.sq_ring_size);
+        if (sqes != MAP_FAILED)
+            munmap(sqes, ring.sqes_size);
+        close(ring.fd);
+        ring.fd = -1;
+        return false;
+    }
+    ring.cq_ring = ring.sq_ring;
+    ring.cq_ring_size = 0;
+    // Multishot accept (5.19) has no feature bit. Kernels without
+    // IORING_FEAT_CQE_SKIP (5.17) are older for sure; the others try it,
+    // and on_accept_done() falls back when the accept is turned down.
+    ring.skip_success = (params.features & IORING_FEAT_CQE_SKIP) ? IOSQE_CQE_SKIP_SUCCESS : 0;
+    ring.multishot_accept = (params.features & IORING_FEAT_CQE_SKIP) != 0;
+
+    char *sq = static_cast<char *>(ring.sq_ring);
+    ring.sq_head = reinterpret_cast<unsigned *>(sq + params.sq_off.head);
+    ring.sq_tail = reinterpret_cast<unsigned *>(sq + params.sq_off.tail);
+    ring.sq_mask = reinterpret_cast<unsigned *>(sq + params.sq_off.ring_mask);
+    ring.sq_array = reinterpret_cast<unsigned *>(sq + params.sq_off.array);
+    ring.sq_entries = params.sq_entries;
+    ring.sqes = static_cast<struct io_uring_sqe *>(sqes);
+    ring.cq_head = reinterpret_cast<unsigned *>(sq + params.cq_off.head);
+    ring.cq_tail = reinterpret_cast<unsigned *>(sq + params.cq_off.tail);
+    ring.cq_mask = reinterpret_cast<unsigned *>(sq + params.cq_off.ring_mask);
+    ring.cqes = reinterpret_cast<struct io_uring_cqe *>(sq + params.cq_off.cqes);
+    return true;
+}
+
+static void destroy_ring(UringBackend &ring)
+{
+    if (ring.fd == -1)
+        return;
+    munmap(ring.sqes, ring.sqes_size);
+    munmap(ring.sq_ring, ring.sq_ring_size);
+    close(ring.fd);
+    ring.fd = -1;
+}
+
+// Hand the queued SQEs to the kernel; wait for one completion when asked,
+// at most timeout_ms (-1 waits without limit)
+static void submit_and_wait(UringBackend &ring, bool wait, int timeout_ms)
+{
+    unsigned flags = 0;
+    struct io_uring_getevents_arg arg;
+    struct __kernel_timespec ts;
+    std::memset(&arg, 0, sizeof(arg));
+    if (wait)
+    {
+        flags |= IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+        if (timeout_ms >= 0)
+        {
+            ts.tv_sec = timeout_ms / 1000;
+            ts.tv_nsec = (timeout_ms % 1000) * 1000000L;
+            arg.ts = reinterpret_cast<unsigned long>(&ts);
+        }
+    }
+    else if (ring.queued == 0)
+        return;
+
+    int ret = sys_io_uring_enter(ring.fd, ring.queued, wait ? 1 : 0, flags,
+                                 wait ? &arg : NULL, wait ? sizeof(arg) : 0);
+    if (ret < 0)
+    {
+        if (errno != EINTR && errno != ETIME && errno != EAGAIN && errno != EBUSY)
+            perror("io_uring_enter");
+        return;
+    }
+    ring.queued -= std::min(ring.queued, static_cast<unsigned>(ret));
+}
+
+// Next free submission entry, cleared. Submits first when the queue is full.
+static struct io_uring_sqe *get_sqe(UringBackend &ring)
+{
+    unsigned tail = *ring.sq_tail;
+    while (tail - __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE) >= ring.sq_entries)
+        submit_and_wait(ring, false, 0);
+
+    unsigned index = tail & *ring.sq_mask;
+    struct io_uring_sqe *sqe = &ring.sqes[index];
+    std::memset(sqe, 0, sizeof(*sqe));
+    ring.sq_array[index] = index;
+    __atomic_store_n(ring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring.queued++;
+    return sqe;
+}
+
+static UringOp *acquire_op(UringBackend &ring, UringOpType type, const ClientRef &ref)
+{
+    UringOp *op;
+    if (ring.free_ops.empty())
+        op = new UringOp();
+    else
+    {
+        op = ring.free_ops.back();
+        ring.free_ops.pop_back();
+    }
+    op->type = type;
+    op->ref = ref;
+    op->file_fd = -1;
+    op->pending = 0;
+    op->length = 0;
+    op->sent = 0;
+    op->file_bytes = 0;
+    op->read_result = 0;
+    op->send_result = 0;
+    return op;
+}
+
+static void release_op(UringBackend &ring, UringOp *op)
+{
+    ring.free_ops.push_back(op);
+}
+
+static void track_fd(UringBackend &ring, int fd)
+{
+    if (static_cast<size_t>(fd) >= ring.inflight.size())
+    {
+        ring.inflight.resize(fd + 1, 0);
+        ring.close_pending.resize(fd + 1, false);
+    }
+    ring.inflight[fd]++;
+}
+
+// A request on fd completed; close fd if that was the last one holding it
+static void untrack_fd(UringBackend &ring, int fd)
+{
+    if (--ring.inflight[fd] == 0 && ring.close_pending[fd])
+    {
+        ring.close_pending[fd] = false;
+        close(fd);
+    }
+}
+
+// Close now, or once the requests still using fd have completed. Closing
+// earlier would let a queued request reach whatever reuses the number.
+static void close_fd(UringBackend &ring, int fd)
+{
+    if (static_cast<size_t>(fd) < ring.inflight.size() && ring.inflight[fd] > 0)
+        ring.close_pending[fd] = true;
+    else
+        close(fd);
+}
+
+static void provide_buffer(UringBackend &ring, int bid)
+{
+    struct io_uring_sqe *sqe = get_sqe(ring);
+    sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+    sqe->fd = 1;
+    sqe->addr = reinterpret_cast<unsigned long>(&ring.buffers[bid * URING_BUFFER_SIZE]);
+    sqe->len = URING_BUFFER_SIZE;
+    sqe->off = bid;
+    sqe->buf_group = URING_BUFFER_GROUP;
+    sqe->flags = ring.skip_success;
+    sqe->user_data = 0;
+}
+
+static void submit_accept(UringBackend &ring, Worker &worker, UringOp *op)
+{
+    struct io_uring_sqe *sqe = get_sqe(ring);
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = worker.servers[op->server].socket_fd;
+    op->multishot = ring.multishot_accept;
+    if (op->multishot)
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    sqe->user_data = reinterpret_cast<unsigned long>(op);
+}
+
+static void submit_epoll_poll(UringBackend &ring, Worker &worker)
+{
+    struct io_uring_sqe *sqe = get_sqe(ring);
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = worker.epfd;
+    sqe->poll32_events = POLLIN;
+    sqe->user_data = reinterpret_cast<unsigned long>(&ring.epoll_op);
+}
+
+static void submit_recv(UringBackend &ring, ChunkedClientInfo &client)
+{
+    UringOp *op = acquire_op(ring, URING_RECV, ClientRef(client.fd, client.generation));
+    struct io_uring_sqe *sqe = get_sqe(ring);
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = client.fd;
+    sqe->len = URING_BUFFER_SIZE;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUFFER_GROUP;
+    sqe->user_data = reinterpret_cast<unsigned long>(op);
+    track_fd(ring, client.fd);
+    client.ring.recv_pending = true;
+}
+
+static void submit_pollout(UringBackend &ring, ChunkedClientInfo &client)
+{
+    UringOp *op = acquire_op(ring, URING_POLLOUT, ClientRef(client.fd, client.generation));
+    struct io_uring_sqe *sqe = get_sqe(ring);
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = client.fd;
+    sqe->poll32_events = POLLOUT;
+    sqe->user_data = reinterpret_cast<unsigned long>(op);
+    track_fd(ring, client.fd);
+    client.ring.send_pending = true;
+}
+
+// Send the unsent part of a file chunk on its own, after a short send
+static void submit_chunk_send(UringBackend &ring, UringOp *op, int socket_fd)
+{
+    struct io_uring_sqe *sqe = get_sqe(ring);
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = socket_fd;
+    sqe->addr = reinterpret_cast<unsigned long>(&op->buffer[op->sent]);
+    sqe->len = op->length - op->sent;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = reinterpret_cast<unsigned long>(op);
+    op->pending = 1;
+    op->read_result = op->file_bytes;
+    track_fd(ring, socket_fd);
+}
+
+// Read the next piece of the file transfer and send it, as one linked
+// pair. Chunked framing is written around the read area up front.
+static void submit_file_chunk(UringBackend &ring, ChunkedClientInfo &client)
+{
+    FileTransfer &transfer = client.transfer;
+    UringOp *op = acquire_op(ring, URING_FILE, ClientRef(client.fd, client.generation));
+    size_t n = std::min(static_cast<size_t>(URING_FILE_CHUNK), static_cast<size_t>(transfer.end - transfer.offset));
+    bool last = (transfer.offset + static_cast<off_t>(n) >= transfer.end);
+
+    std::string head;
+    std::string tail;
+    if (transfer.framing == FRAMING_CHUNKED)
+    {
+        if (n > 0)
+        {
+            std::ostringstream chunkHeader;
+            chunkHeader << std::hex << n << "\r\n";
+            head = chunkHeader.str();
+            tail = "\r\n";
+        }
+        if (last)
+            tail += "0\r\n\r\n";
+    }
+    op->buffer.resize(head.size() + n + tail.size());
+    std::memcpy(&op->buffer[0], head.data(), head.size());
+    if (!tail.empty())
+        std::memcpy(&op->buffer[head.size() + n], tail.data(), tail.size());
+    op->length = op->buffer.size();
+    op->file_bytes = n;
+    op->file_fd = transfer.fd;
+    client.ring.send_pending = true;
+
+    if (op->length == 0)
+    {
+        // Empty Content-Length body: nothing to read or send
+        release_op(ring, op);
+        client.ring.send_pending = false;
+        transfer.close();
+        return;
+    }
+    if (n == 0)
+    {
+        // Only the final chunk of an empty file is left
+        submit_chunk_send(ring, op, client.fd);
+        return;
+    }
+
+    struct io_uring_sqe *sqe = get_sqe(ring);
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = transfer.fd;
+    sqe->addr = reinterpret_cast<unsigned long>(&op->buffer[head.size()]);
+    sqe->len = n;
+    sqe->off = transfer.offset;
+    sqe->flags = IOSQE_IO_LINK; // A short read cancels the send
+    sqe->user_data = reinterpret_cast<unsigned long>(op) | 1;
+    track_fd(ring, transfer.fd);
+
+    sqe = get_sqe(ring);
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = client.fd;
+    sqe->addr = reinterpret_cast<unsigned long>(&op->buffer[0]);
+    sqe->len = op->length;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = reinterpret_cast<unsigned long>(op);
+    track_fd(ring, client.fd);
+    op->pending = 2;
+}
+
+// Write a piece of an upload at the file's offset, from a copy of the data
+// since the caller's buffer is gone before the kernel gets to it
+void uring_write_upload(Worker &worker, UploadFile &file, const char *data, size_t size)
+{
+    UringBackend &ring = *worker.ring;
+    UringOp *op = acquire_op(ring, URING_WRITE, file.owner);
+    op->buffer.assign(data, data + size);
+    op->length = size;
+    op->file_fd = file.fd;
+
+    struct io_uring_sqe *sqe = get_sqe(ring);
+    sqe->opcode = IORING_OP_WRITE;
+    sqe->fd = file.fd;
+    sqe->addr = reinterpret_cast<unsigned long>(&op->buffer[0]);
+    sqe->len = size;
+    sqe->off = file.offset;
+    sqe->user_data = reinterpret_cast<unsigned long>(op);
+    track_fd(ring, file.fd);
+    ring.writes++;
+    file.pending++;
+}
+
+void uring_close_upload(Worker &worker, int fd)
+{
+    close_fd(*worker.ring, fd);
+}
+
+static void return_input_buffer(UringBackend &ring, ChunkedClientInfo &client)
+{
+    if (client.ring.buffer == -1)
+        return;
+    provide_buffer(ring, client.ring.buffer);
+    client.ring.buffer = -1;
+    client.ring.data = NULL;
+    client.ring.size = 0;
+
+    // A buffer is free again: retry the receives that found none
+    std::vector<ClientRef> starved;
+    starved.swap(ring.starved);
+    for (size_t i = 0; i < starved.size(); ++i)
+        ring.ready.push_back(starved[i]);
+}
+
+// Write what the socket takes right now, then leave the rest to the ring:
+// a POLLOUT request for queued output, a linked read/send for file data.
+void uring_write_client(Worker &worker, ChunkedClientInfo &client)
+{
+    UringBackend &ring = *worker.ring;
+    if (client.ring.send_pending)
+        return;
+
+    if (!client.output.empty())
+    {
+        ssize_t sent = client.output.flush(client.fd);
+        if (sent < 0)
+        {
+            fail_client(client);
+            return;
+        }
+        if (sent > 0)
+            client.last_active = worker.now;
+        if (!client.output.empty())
+        {
+            submit_pollout(ring, client);
+            return;
+        }
+    }
+    if (client.transfer.active())
+        submit_file_chunk(ring, client);
+}
+
+// After a wakeup: give back the receive buffer once it is consumed, and
+// keep one receive outstanding while the client reads requests
+void uring_arm_client(Worker &worker, ChunkedClientInfo &client)
+{
+    UringBackend &ring = *worker.ring;
+    bool reading = client.is_active && (client.upload_state == 0 || client.upload_state == 1);
+
+    if (client.ring.size > 0 && reading)
+    {
+        // The read budget ran out with bytes left: continue next round
+        ring.ready.push_back(ClientRef(client.fd, client.generation));
+        return;
+    }
+    // While a response is prepared or drains, the next request waits in the
+    // buffer or the socket
+    if (client.is_active && client.upload_state >= 3 && client.upload_state <= 5)
+        return;
+    return_input_buffer(ring, client);
+    if (client.is_active && !client.ring.recv_pending && !client.ring.eof && !client.ring.error)
+        submit_recv(ring, client);
+}
+
+void uring_close_client(Worker &worker, ChunkedClientInfo &client)
+{
+    UringBackend &ring = *worker.ring;
+    return_input_buffer(ring, client);
+    if (client.transfer.active())
+    {
+        close_fd(ring, client.transfer.fd);
+        client.transfer.fd = -1;
+    }
+    // Pending receives and polls complete once the socket is shut down
+    if (client.ring.recv_pending || client.ring.send_pending)
+        shutdown(client.fd, SHUT_RDWR);
+    close_fd(ring, client.fd);
+}
+
+static bool is_listening(int fd)
+{
+    int listening = 0;
+    socklen_t length = sizeof(listening);
+    return getsockopt(fd, SOL_SOCKET, SO_ACCEPTCONN, &listening, &length) == 0 && listening;
+}
+
+static void on_accept_done(Worker &worker, UringOp *op, struct io_uring_cqe *cqe)
+{
+    if (worker.servers[op->server].socket_fd == -1)
+    {
+        // A reload removed the listener and cancelled this accept; a
+        // connection that made it through has no server block any more
+        if (cqe->res >= 0)
+            close(cqe->res);
+        if (!(cqe->flags & IORING_CQE_F_MORE))
+            release_op(*worker.ring, op);
+        return;
+    }
+    // Shedding load cancelled this accept; resuming may have started a new one
+    bool cancelled = op->server >= worker.ring->accepts.size() || worker.ring->accepts[op->server] != op;
+    if (cqe->res >= 0)
+    {
+        size_t index = worker.servers[op->server].config_index;
+        worker.servers[op->server].stats.accepted++;
+        add_client_to_epoll(worker, cqe->res, worker.config->global_obj[index], index);
+    }
+    else if (!cancelled && cqe->res == -EINVAL && op->multishot &&
+             is_listening(worker.servers[op->server].socket_fd))
+    {
+        // A kernel before 5.19 rejects the multishot flag: from now on
+        // accept one connection per request, resubmitted below. Every
+        // listener's first accept fails this way, the warning shows once.
+        if (worker.ring->multishot_accept)
+            std::cerr << "Worker " << worker.id << ": io_uring multishot accept unsupported, "
+                      << "accepting one connection per request" << std::endl;
+        worker.ring->multishot_accept = false;
+    }
+    else if (!cancelled && (cqe->res == -EINVAL || cqe->res == -EBADF || cqe->res == -ENOTSOCK))
+    {
+        // Not a listening socket (its bind failed), or a single accept is
+        // refused too: stop accepting on it
+        std::cerr << "io_uring accept on listener " << op->server << ": " << strerror(-cqe->res) << std::endl;
+        worker.ring->accepts[op->server] = NULL;
+        release_op(*worker.ring, op);
+        return;
+    }
+    else if (!cancelled && cqe->res != -EAGAIN && cqe->res != -ECONNABORTED)
+        std::cerr << "io_uring accept: " << strerror(-cqe->res) << std::endl;
+
+    // The accept ended (a single one, an error or an overflow): start a new one
+    if (!(cqe->flags & IORING_CQE_F_MORE))
+    {
+        if (cancelled)
+            release_op(*worker.ring, op);
+        else
+            submit_accept(*worker.ring, worker, op);
+    }
+}
+
+// Start a multishot accept on worker.servers[index]
+bool uring_watch_listener(Worker &worker, size_t index)
+{
+    UringBackend &ring = *worker.ring;
+    if (ring.accepts.size() <= index)
+        ring.accepts.resize(index + 1, NULL);
+    UringOp *op = acquire_op(ring, URING_ACCEPT, ClientRef());
+    op->server = index;
+    ring.accepts[index] = op;
+    submit_accept(ring, worker, op);
+    return true;
+}
+
+// Cancel the listener's accept before its socket is closed. The socket
+// may be shared with other processes, so it is not shut down.
+void uring_unwatch_listener(Worker &worker, size_t index)
+{
+    UringBackend &ring = *worker.ring;
+    if (index >= ring.accepts.size() || !ring.accepts[index])
+        return;
+    struct io_uring_sqe *sqe = get_sqe(ring);
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = reinterpret_cast<unsigned long>(ring.accepts[index]);
+    sqe->flags = ring.skip_success;
+    sqe->user_data = reinterpret_cast<unsigned long>(&ring.cancel_op);
+    ring.accepts[index] = NULL;
+}
+
+static void on_recv_done(Worker &worker, UringOp *op, struct io_uring_cqe *cqe)
+{
+    UringBackend &ring = *worker.ring;
+    ChunkedClientInfo *client = worker.clients.find(op->ref);
+    int bid = (cqe->flags & IORING_CQE_F_BUFFER) ? static_cast<int>(cqe->flags >> IORING_CQE_BUFFER_SHIFT) : -1;
+    untrack_fd(ring, op->ref.fd);
+    release_op(ring, op);
+
+    if (!client)
+    {
+        if (bid != -1)
+            provide_buffer(ring, bid);
+        return;
+    }
+    client->ring.recv_pending = false;
+    if (cqe->res == -ENOBUFS)
+    {
+        ring.starved.push_back(ClientRef(client->fd, client->generation));
+        return;
+    }
+    if (cqe->res > 0)
+    {
+        client->ring.buffer = bid;
+        client->ring.data = &ring.buffers[bid * URING_BUFFER_SIZE];
+        client->ring.size = cqe->res;
+    }
+    else if (cqe->res == 0)
+        client->ring.eof = true;
+    else
+        client->ring.error = -cqe->res;
+    on_client_event(worker, client, EPOLLIN);
+}
+
+static void on_pollout_done(Worker &worker, UringOp *op, struct io_uring_cqe *cqe)
+{
+    UringBackend &ring = *worker.ring;
+    ChunkedClientInfo *client = worker.clients.find(op->ref);
+    untrack_fd(ring, op->ref.fd);
+    release_op(ring, op);
+    if (!client)
+        return;
+
+    client->ring.send_pending = false;
+    on_client_event(worker, client, (cqe->res & POLLERR) ? EPOLLERR : EPOLLOUT);
+}
+
+static void on_file_done(Worker &worker, UringOp *op, struct io_uring_cqe *cqe, bool read_half)
+{
+    UringBackend &ring = *worker.ring;
+    if (read_half)
+    {
+        op->read_result = cqe->res;
+        untrack_fd(ring, op->file_fd);
+    }
+    else
+    {
+        op->send_result = cqe->res;
+        untrack_fd(ring, op->ref.fd);
+    }
+    if (--op->pending > 0)
+        return;
+
+    ChunkedClientInfo *client = worker.clients.find(op->ref);
+    if (!client)
+    {
+        release_op(ring, op);
+        return;
+    }
+    client->ring.send_pending = false;
+
+    bool failed = false;
+    if (op->file_bytes > 0 && op->read_result != static_cast<ssize_t>(op->file_bytes))
+    {
+        std::cerr << "File ended before the announced length" << std::endl;
+        failed = true;
+    }
+    else if (op->send_result < 0)
+        failed = true;
+    else
+    {
+        op->sent += op->send_result;
+        if (op->sent < op->length)
+        {
+            // Short send: the socket took part of the chunk
+            client->last_active = worker.now;
+            client->ring.send_pending = true;
+            submit_chunk_send(ring, op, client->fd);
+            return;
+        }
+    }
+    release_op(ring, op);
+
+    if (failed)
+    {
+        client->output.clear();
+        client->transfer.close();
+        client->is_active = false;
+    }
+    else
+    {
+        client->last_active = worker.now;
+        client->transfer.offset += op->file_bytes;
+        if (client->transfer.offset >= client->transfer.end)
+            client->transfer.close();
+    }
+    on_client_event(worker, client, EPOLLOUT);
+}
+
+// An upload write completed. A failed or short one leaves the file
+// incomplete, as a failed write() did. The request is answered after the
+// last one.
+static void on_write_done(Worker &worker, UringOp *op, struct io_uring_cqe *cqe)
+{
+    UringBackend &ring = *worker.ring;
+    ChunkedClientInfo *client = worker.clients.find(op->ref);
+    untrack_fd(ring, op->file_fd);
+    ring.writes--;
+    if (cqe->res < 0)
+        std::cerr << "Upload write failed: " << strerror(-cqe->res) << std::endl;
+    else if (static_cast<size_t>(cqe->res) < op->length)
+        std::cerr << "Upload write failed: short write" << std::endl;
+    release_op(ring, op);
+
+    if (!client || client->file_stream.pending == 0)
+        return;
+    if (--client->file_stream.pending == 0 && client->io_pending && client->upload_state == 5)
+        finish_upload(worker, *client);
+}
+
+// Something registered with epoll is ready: dispatch it like the epoll loop
+static void on_epoll_ready(Worker &worker)
+{
+    struct epoll_event events[MAX_EVENTS];
+    int nfds = epoll_wait(worker.epfd, events, MAX_EVENTS, 0);
+    for (int i = 0; i < nfds; i++)
+    {
+        EventHandle *handle = static_cast<EventHandle *>(events[i].data.ptr);
+        handle->on_event(worker, handle, events[i].events);
+    }
+    submit_epoll_poll(*worker.ring, worker);
+}
+
+static void dispatch_completion(Worker &worker, struct io_uring_cqe *cqe)
+{
+    unsigned long data = cqe->user_data;
+    if (data == 0)
+    {
+        if (cqe->res < 0)
+            std::cerr << "io_uring: providing a buffer failed: " << strerror(-cqe->res) << std::endl;
+        return;
+    }
+    UringOp *op = reinterpret_cast<UringOp *>(data & ~1UL);
+    switch (op->type)
+    {
+    case URING_ACCEPT:
+        on_accept_done(worker, op, cqe);
+        break;
+    case URING_RECV:
+        on_recv_done(worker, op, cqe);
+        break;
+    case URING_POLLOUT:
+        on_pollout_done(worker, op, cqe);
+        break;
+    case URING_FILE:
+        on_file_done(worker, op, cqe, (data & 1) != 0);
+        break;
+    case URING_EPOLL:
+        on_epoll_ready(worker);
+        break;
+    case URING_CANCEL:
+        // The accept it targeted reports the outcome
+        break;
+    case URING_WRITE:
+        on_write_done(worker, op, cqe);
+        break;
+    }
+}
+
+// Clients whose receive buffer still holds bytes, or that waited for one
+static void run_ready_clients(Worker &worker)
+{
+    UringBackend &ring = *worker.ring;
+    std::vector<ClientRef> ready;
+    ready.swap(ring.ready);
+    for (size_t i = 0; i < ready.size(); ++i)
+    {
+        ChunkedClientInfo *client = worker.clients.find(ready[i]);
+        if (!client)
+            continue;
+        if (client->ring.size > 0)
+            on_client_event(worker, client, EPOLLIN);
+        else if (client->is_active && !client->ring.recv_pending)
+            submit_recv(ring, *client);
+    }
+}
+
+// A drained worker is done with its ring. No client is left, but the
+// uploads of closed clients may still be writing: those finish first, so
+// their files are complete and closed. Then only listener accepts and the
+// epoll poll can be in flight; closing the ring cancels them.
+// close_worker() then finds the worker on epoll terms.
+static void release_ring(Worker &worker)
+{
+    UringBackend *ring = worker.ring;
+    while (ring->writes > 0)
+    {
+        submit_and_wait(*ring, true, -1);
+        unsigned head = *ring->cq_head;
+        unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+        while (head != tail)
+        {
+            struct io_uring_cqe cqe = ring->cqes[head & *ring->cq_mask];
+            head++;
+            __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+            // Only the writes matter now; a connection accepted meanwhile
+            // is turned away
+            UringOp *op = reinterpret_cast<UringOp *>(cqe.user_data & ~1UL);
+            if (op && op->type == URING_WRITE)
+                on_write_done(worker, op, &cqe);
+            else if (op && op->type == URING_ACCEPT && cqe.res >= 0)
+                close(cqe.res);
+        }
+    }
+    destroy_ring(*ring);
+    for (size_t i = 0; i < ring->free_ops.size(); ++i)
+        delete ring->free_ops[i];
+    for (size_t i = 0; i < ring->accepts.size(); ++i)
+        delete ring->accepts[i];
+    delete ring;
+    worker.ring = NULL;
+}
+
+// Run the worker on io_uring. Returns false, with nothing changed, when the
+// ring can not be set up. Otherwise it runs until check_worker() ends a
+// draining worker, then releases the ring and returns true.
+bool run_uring_event_loop(Worker &worker)
+{
+    UringBackend *ring = new UringBackend();
+    if (!setup_ring(*ring))
+    {
+        delete ring;
+        std::cerr << "Worker " << worker.id << ": io_uring unavailable, using epoll" << std::endl;
+        return false;
+    }
+
+    ring->buffers.resize(static_cast<size_t>(URING_BUFFERS) * URING_BUFFER_SIZE);
+    struct io_uring_sqe *sqe = get_sqe(*ring);
+    sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+    sqe->fd = URING_BUFFERS;
+    sqe->addr = reinterpret_cast<unsigned long>(&ring->buffers[0]);
+    sqe->len = URING_BUFFER_SIZE;
+    sqe->off = 0;
+    sqe->buf_group = URING_BUFFER_GROUP;
+    sqe->user_data = 0;
+    submit_and_wait(*ring, true, 1000);
+    struct io_uring_cqe *first = &ring->cqes[*ring->cq_head & *ring->cq_mask];
+    if (*ring->cq_head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE) || first->res < 0)
+    {
+        std::cerr << "Worker " << worker.id << ": io_uring buffer setup failed, using epoll" << std::endl;
+        destroy_ring(*ring);
+        delete ring;
+        return false;
+    }
+    __atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+
+    worker.ring = ring;
+    ring->epoll_op.type = URING_EPOLL;
+    ring->cancel_op.type = URING_CANCEL;
+    submit_epoll_poll(*ring, worker);
+    // Listeners move from epoll to multishot accepts
+    for (size_t i = 0; i < worker.servers.size(); ++i)
+    {
+        if (worker.servers[i].socket_fd == -1)
+            continue;
+        epoll_ctl(worker.epfd, EPOLL_CTL_DEL, worker.servers[i].socket_fd, NULL);
+        uring_watch_listener(worker, i);
+    }
+    std::cout << "Worker " << worker.id << " running on io_uring" << std::endl;
+
+    while (true)
+    {
+        worker.now = time(NULL);
+        bool idle = ring->ready.empty() && worker.runnable.empty();
+        submit_and_wait(*ring, idle, overload_timeout(worker, idle ? worker.timers.next_timeout(worker.now) : 0));
+        struct timespec woke;
+        clock_gettime(CLOCK_MONOTONIC, &woke);
+        worker.now = time(NULL);
+        size_t queued = ring->ready.size() + worker.runnable.size();
+
+        unsigned head = *ring->cq_head;
+        unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+        while (head != tail)
+        {
+            struct io_uring_cqe cqe = ring->cqes[head & *ring->cq_mask];
+            head++;
+            // Free the slot before dispatching, which may queue more work
+            __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+            dispatch_completion(worker, &cqe);
+            if (head == tail)
+                tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+        }
+
+        run_ready_clients(worker);
+        run_queued_clients(worker);
+        close_finished_clients(worker);
+        update_overload(worker, woke, queued);
+        if (!check_worker(worker))
+            break;
+    }
+    release_ring(worker);
+    return true;
+}
+
+#else
+
+bool run_uring_event_loop(Worker &worker)
+{
+    std::cerr << "Worker " << worker.id << ": built without io_uring support (make IO_URING=1), using epoll"
+              << std::endl;
+    return false;
+}
+
+void uring_write_client(Worker &worker, ChunkedClientInfo &client)
+{
+    (void)worker;
+    (void)client;
+}
+
+void uring_arm_client(Worker &worker, ChunkedClientInfo &client)
+{
+    (void)worker;
+    (void)client;
+}
+
+void uring_close_client(Worker &worker, ChunkedClientInfo &client)
+{
+    (void)worker;
+    (void)client;
+}
+
+void uring_write_upload(Worker &worker, UploadFile &file, const char *data, size_t size)
+{
+    (void)worker;
+    (void)file;
+    (void)data;
+    (void)size;
+}
+
+void uring_close_upload(Worker &worker, int fd)
+{
+    (void)worker;
+    (void)fd;
+}
+
+bool uring_watch_listener(Worker &worker, size_t index)
+{
+    (void)worker;
+    (void)index;
+    return false;
+}
+
+void uring_unwatch_listener(Worker &worker, size_t index)
+{
+    (void)worker;
+    (void)index;
+}
+
+#endif
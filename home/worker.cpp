@@ -0,0 +1,1064 @@
+#include "server.hpp"
+#include <signal.h>
+#include <algorithm>
+#include <sys/eventfd.h>
+
+static void on_listener_event(Worker &worker, EventHandle *handle, uint32_t events);
+static void on_io_done(Worker &worker, EventHandle *handle, uint32_t events);
+static void on_wakeup(Worker &worker, EventHandle *handle, uint32_t events);
+
+// Set by SIGQUIT in a pre-fork worker whose master reloaded
+static volatile sig_atomic_t drain_requested = 0;
+
+// Worker running on this thread, so response code that only knows the
+// client fd can reach the connection's output queue
+static __thread Worker *current_worker = NULL;
+
+ChunkedClientInfo *find_current_client(int fd)
+{
+    if (!current_worker)
+        return find_io_client(fd);
+    return current_worker->clients.find(fd);
+}
+
+// Worker running on this thread, NULL on I/O threads
+Worker *running_worker()
+{
+    return current_worker;
+}
+
+// The prebuilt 503 while the worker on this thread sheds load, NULL
+// otherwise. A request that gets it counts as shed.
+const std::string *overload_response()
+{
+    if (!current_worker || !current_worker->overload.shedding)
+        return NULL;
+    current_worker->overload.shed++;
+    return &current_worker->overload.response;
+}
+
+// Create this worker's epoll instance and its own copy of every listener.
+// SO_REUSEPORT lets each worker bind the same host:port, and the kernel
+// spreads incoming connections across them.
+bool setup_worker(Worker &worker)
+{
+    std::map<int, size_t> socket_fd_to_default_index;
+
+    worker.servers.reserve(worker.config->global_obj.size());
+    setup_all_sockets(worker.servers, worker.config->global_obj, worker.config->hostport_to_indexes,
+                      socket_fd_to_default_index);
+    return register_listeners(worker);
+}
+
+// Start accepting on worker.servers[index]. op is EPOLL_CTL_MOD when the
+// listener is registered already and only moved in memory.
+static bool watch_listener(Worker &worker, size_t index, int op)
+{
+    if (worker.ring)
+        return uring_watch_listener(worker, index);
+
+    worker.servers[index].on_event = on_listener_event;
+    struct epoll_event ev;
+    ev.events = worker.global->edge_triggered ? (EPOLLIN | EPOLLET) : EPOLLIN;
+    ev.data.ptr = static_cast<EventHandle *>(&worker.servers[index]);
+    if (epoll_ctl(worker.epfd, op, worker.servers[index].socket_fd, &ev) == -1)
+    {
+        perror("epoll_ctl: server socket");
+        return false;
+    }
+    return true;
+}
+
+static void unwatch_listener(Worker &worker, size_t index)
+{
+    if (worker.ring)
+        uring_unwatch_listener(worker, index);
+    else
+        epoll_ctl(worker.epfd, EPOLL_CTL_DEL, worker.servers[index].socket_fd, NULL);
+}
+
+// Stop accepting on worker.servers[index] and close it. The slot stays,
+// marked by socket_fd -1.
+static void stop_listener(Worker &worker, size_t index)
+{
+    ServerInfo &server = worker.servers[index];
+    unwatch_listener(worker, index);
+    close(server.socket_fd);
+    server.socket_fd = -1;
+    server.fd = -1;
+}
+
+// Whether a paused worker takes its listeners out of their SO_REUSEPORT
+// groups. The kernel keeps hashing new connections to a socket that is
+// only left out of epoll, so with other worker threads listening on the
+// same addresses through their own sockets, it is shut down for them to
+// take its share. Pre-forked workers share one socket, which the others
+// keep accepting from, and a single worker has nobody to hand over to.
+static bool leaves_reuseport_group(const Worker &worker)
+{
+    return worker.global->worker_processes <= 1 && worker.global->worker_threads > 1;
+}
+
+// Stop, or start again, accepting on every listener while the worker sheds
+// load. A socket that stays in its group keeps its queue for later; one
+// that leaves accepts its queue first, since shutdown() would reset those
+// connections, and listen() puts it back.
+void pause_listeners(Worker &worker)
+{
+    bool leave = leaves_reuseport_group(worker);
+    for (size_t i = 0; i < worker.servers.size(); ++i)
+    {
+        ServerInfo &server = worker.servers[i];
+        if (server.socket_fd == -1)
+            continue;
+        unwatch_listener(worker, i);
+        if (!leave)
+            continue;
+        while (handle_new_connections(worker, server))
+            ;
+        shutdown(server.socket_fd, SHUT_RD);
+    }
+}
+
+void resume_listeners(Worker &worker)
+{
+    bool rejoin = leaves_reuseport_group(worker);
+    for (size_t i = 0; i < worker.servers.size(); ++i)
+    {
+        ServerInfo &server = worker.servers[i];
+        if (server.socket_fd == -1)
+            continue;
+        if (rejoin && listen(server.socket_fd, server.backlog) == -1)
+        {
+            perror("listen: resuming listener");
+            continue;
+        }
+        watch_listener(worker, i, EPOLL_CTL_ADD);
+    }
+}
+
+// Create the epoll instance and add the listeners already in worker.servers
+bool register_listeners(Worker &worker)
+{
+    worker.epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (worker.epfd == -1)
+    {
+        perror("epoll_create1 failed");
+        close_worker(worker);
+        return false;
+    }
+
+    // Add all server sockets to epoll
+    size_t listening = 0;
+    for (size_t i = 0; i < worker.servers.size(); ++i)
+    {
+        if (worker.servers[i].socket_fd == -1)
+            continue;
+        if (!watch_listener(worker, i, EPOLL_CTL_ADD))
+        {
+            close_worker(worker);
+            return false;
+        }
+        listening++;
+    }
+    std::cout << "Worker " << worker.id << " ready with " << listening
+              << " listeners (epoll fd " << worker.epfd << ")" << std::endl;
+    return true;
+}
+
+void close_worker(Worker &worker)
+{
+    for (size_t fd = 0; fd < worker.clients.capacity(); ++fd)
+    {
+        ChunkedClientInfo *client = worker.clients.find(fd);
+        PendingClient *pending = worker.clients.find_pending(fd);
+        if (client)
+            close_client(worker, ClientRef(fd, client->generation));
+        else if (pending)
+            close_client(worker, ClientRef(fd, pending->generation));
+    }
+    if (worker.epfd != -1)
+        close(worker.epfd);
+    worker.epfd = -1;
+    if (worker.io_done.fd != -1)
+        close(worker.io_done.fd);
+    worker.io_done.fd = -1;
+    if (worker.wakeup.fd != -1)
+    {
+        unwatch_config(worker.wakeup.fd);
+        close(worker.wakeup.fd);
+    }
+    worker.wakeup.fd = -1;
+    for (size_t i = 0; i < worker.servers.size(); ++i)
+    {
+        if (worker.servers[i].socket_fd != -1)
+            close(worker.servers[i].socket_fd);
+    }
+    worker.servers.clear();
+    release_config(worker.config);
+    worker.config = NULL;
+}
+
+// Hand the response of a request waiting in state 5 to the I/O pool, or
+// prepare it here when there is no pool or its queue is full
+void dispatch_response(Worker &worker, ChunkedClientInfo &client)
+{
+    if (submit_io_job(worker, client))
+    {
+        client.io_pending = true;
+        return;
+    }
+    send_response(client.fd, client);
+    finish_request(client);
+}
+
+// A reload was published while the connection waited for its next
+// request: move it to the worker's configuration, through the server block
+// that now owns the address it connected to. Fails when that address is
+// gone.
+static bool follow_config(Worker &worker, ChunkedClientInfo &client)
+{
+    std::string address = listen_address(client.config->global_obj[client.listen_index].server);
+    std::map<std::string, std::vector<size_t> >::const_iterator it = worker.config->hostport_to_indexes.find(address);
+    if (it == worker.config->hostport_to_indexes.end() || it->second.empty())
+        return false;
+    retain_config(worker.config);
+    release_config(client.config);
+    client.config = worker.config;
+    client.listen_index = it->second[0];
+    client.server_index = client.listen_index;
+    return true;
+}
+
+// Before the client's request is parsed further: a request that has not
+// started yet runs on the latest configuration. False, with the client
+// marked inactive, when that configuration no longer serves its address.
+bool begin_client_turn(Worker &worker, ChunkedClientInfo &client)
+{
+    if (client.upload_state == 0 && client.config != worker.config && !follow_config(worker, client))
+    {
+        client.is_active = false;
+        return false;
+    }
+    client.request_obj.epfd = worker.epfd;
+    return true;
+}
+
+// Run the client's state machine for one wakeup. In EPOLLET mode, keep
+// reading until the socket is drained, the request stops reading, or the
+// per-wakeup byte budget is spent. Returns true when the budget ran out
+// with data still pending.
+bool run_client(Worker &worker, int fd, ChunkedClientInfo &client, size_t client_server_idx)
+{
+    if (!begin_client_turn(worker, client))
+        return false;
+    // follow_config() may have moved it to another server block
+    client_server_idx = client.server_index;
+    client.wakeup_bytes = 0;
+    client.socket_drained = false;
+    while (true)
+    {
+        handle_request_chunked(fd, client, client.config->global_obj,
+                               client.config->hostport_to_indexes, client_server_idx);
+        if (client.upload_state == 5 && !client.io_pending)
+            dispatch_response(worker, client);
+        bool drain = worker.global->edge_triggered || worker.ring;
+        if (!drain || !client.is_active || client.socket_drained)
+            return false;
+        if (client.upload_state != 0 && client.upload_state != 1)
+            return false;
+        if (client.wakeup_bytes >= worker.global->read_budget)
+            return true;
+    }
+}
+
+// Register the interest the client needs now: EPOLLIN while a request is
+// being read, EPOLLOUT while output or a file transfer is pending. A client
+// waiting on a CGI script or an I/O thread is not read meanwhile. In
+// EPOLLET mode a MOD with unchanged events is how pending input, or a
+// socket that still has room, gets reported again.
+static void update_client_events(Worker &worker, ChunkedClientInfo &client, bool rearm)
+{
+    uint32_t events = 0;
+    if (client.is_active && client.upload_state < 3)
+        events |= EPOLLIN;
+    if (!client.output.empty() || client.transfer.active())
+        events |= EPOLLOUT;
+    if (worker.global->edge_triggered)
+        events |= EPOLLET;
+    if (events == client.epoll_events && !rearm)
+        return;
+
+    struct epoll_event ev;
+    ev.events = events;
+    ev.data.ptr = static_cast<EventHandle *>(&client);
+    if (epoll_ctl(worker.epfd, EPOLL_CTL_MOD, client.fd, &ev) == 0)
+        client.epoll_events = events;
+}
+
+// The previous response is queued or sent: read the next request on the
+// same connection, starting from the listener's server block again and
+// from the bytes the client pipelined behind the previous one. Returns
+// false, with the client marked inactive, when the connection should close
+// instead.
+bool start_next_request(Worker &worker, ChunkedClientInfo &client)
+{
+    if (worker.draining && client.pipelined.empty())
+    {
+        client.is_active = false;
+        return false;
+    }
+    client.reset_request();
+    client.partial_data.swap(client.pipelined);
+    client.requests++;
+    client.server_index = client.listen_index;
+    // The idle deadline counts from now even if the phase never showed as 4
+    client.timer_phase = -1;
+    return true;
+}
+
+// Give the client another turn once this round's events are handled: its
+// next request is buffered, or it spent its read or send budget with work
+// left. Every queued client gets one budgeted turn per round, in order,
+// which is fairer than re-arming its fd and cheaper by a syscall.
+void schedule_client(Worker &worker, ChunkedClientInfo &client)
+{
+    if (client.scheduled)
+        return;
+    client.scheduled = true;
+    worker.runnable.push_back(ClientRef(client.fd, client.generation));
+}
+
+// The socket failed: nothing queued can be delivered any more
+void fail_client(ChunkedClientInfo &client)
+{
+    client.output.clear();
+    client.transfer.close();
+    client.is_active = false;
+}
+
+// Write queued output and the file transfer, up to SEND_BUDGET bytes.
+// budget_spent tells whether the write stopped at the budget rather than
+// at a full socket. False, with the client failed, when the socket failed.
+bool send_client_output(Worker &worker, ChunkedClientInfo &client, bool &budget_spent)
+{
+    ssize_t sent = write_client(client, SEND_BUDGET);
+    budget_spent = sent >= 0 && static_cast<size_t>(sent) >= SEND_BUDGET;
+    if (sent < 0)
+    {
+        fail_client(client);
+        return false;
+    }
+    if (sent > 0)
+        client.last_active = worker.now;
+    return true;
+}
+
+// Write queued output and the file transfer, then close the client if it
+// is finished and fully sent, or register for whatever it waits on next.
+// A finished client stays open until the peer has taken the whole response.
+static void flush_client(Worker &worker, ChunkedClientInfo &client, bool rearm)
+{
+    if (worker.ring)
+        uring_write_client(worker, client);
+    else if (!client.output.empty() || client.transfer.active())
+    {
+        bool budget_spent;
+        // Budget spent with the socket still writable: yield, and come
+        // back next round, since an edge-triggered fd reports no more
+        // EPOLLOUT for a socket that never filled up
+        if (send_client_output(worker, client, budget_spent) && budget_spent && worker.global->edge_triggered)
+            schedule_client(worker, client);
+    }
+
+    bool sent_all = client.output.empty() && !client.transfer.active();
+    if (client.is_active && client.upload_state == 4 && sent_all && start_next_request(worker, client))
+    {
+        // Input that arrived meanwhile gave its EPOLLET edge already, and a
+        // buffered request gets no event at all
+        rearm = true;
+        if (!client.partial_data.empty())
+            schedule_client(worker, client);
+    }
+    if (!client.is_active && sent_all)
+    {
+        worker.closing.push_back(ClientRef(client.fd, client.generation));
+        return;
+    }
+    update_client_timer(worker, client);
+    if (worker.ring)
+        uring_arm_client(worker, client);
+    else
+        update_client_events(worker, client, rearm);
+}
+
+// Start the request the client pipelined behind the one just answered, if
+// it is buffered and its response can queue behind the previous one. A
+// file body still on the transfer slot moves into the queue first; when it
+// is too large for that, the next request waits until it is sent.
+bool start_pipelined_request(Worker &worker, ChunkedClientInfo &client)
+{
+    if (!client.is_active || client.upload_state != 4 || client.pipelined.empty())
+        return false;
+    if (client.output.size() >= OUTPUT_FLUSH_THRESHOLD)
+        return false;
+    if (client.transfer.active() && !queue_transfer(client, OUTPUT_FLUSH_THRESHOLD))
+        return false;
+    return start_next_request(worker, client);
+}
+
+// Answer the pipelined requests that are already buffered, so their
+// responses leave in one write batch with the one before, then flush
+static void serve_pipelined(Worker &worker, ChunkedClientInfo &client, bool budget_spent)
+{
+    for (int i = 0; i < PIPELINE_BATCH && start_pipelined_request(worker, client); ++i)
+    {
+        if (run_client(worker, client.fd, client, client.server_index))
+            budget_spent = true;
+    }
+    // The ring keeps its own list of clients with received bytes left
+    if (budget_spent && !worker.ring)
+        schedule_client(worker, client);
+    flush_client(worker, client, false);
+}
+
+// Service one wakeup and flush what it produced. When the EPOLLET budget
+// ran out, the client reads the rest on its next turn.
+static void service_client(Worker &worker, int fd, ChunkedClientInfo &client, size_t client_server_idx)
+{
+    serve_pipelined(worker, client, run_client(worker, fd, client, client_server_idx));
+}
+
+// I/O threads finished some responses: move each into its connection,
+// unless the connection closed while the job ran
+static void on_io_done(Worker &worker, EventHandle *handle, uint32_t events)
+{
+    (void)events;
+    uint64_t count;
+    if (read(handle->fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+        perror("io eventfd read failed");
+
+    std::vector<IoJob *> finished;
+    pthread_mutex_lock(&worker.io_lock);
+    finished.swap(worker.io_finished);
+    pthread_mutex_unlock(&worker.io_lock);
+
+    for (size_t i = 0; i < finished.size(); ++i)
+    {
+        IoJob *job = finished[i];
+        ChunkedClientInfo *client = worker.clients.find(job->ref);
+        if (client && client->io_pending)
+        {
+            client->io_pending = false;
+            return_response_context(*client, *job);
+            client->output.append(job->client.output);
+            client->transfer = job->client.transfer;
+            job->client.transfer.fd = -1;
+            if (!job->client.is_active)
+                client->is_active = false;
+            if (!wake_connection_task(*client, TASK_IO_JOB, 0))
+            {
+                finish_request(*client);
+                serve_pipelined(worker, *client, false);
+            }
+        }
+        job->client.transfer.close();
+        release_config(job->client.config);
+        delete job;
+    }
+}
+
+// The last ring write of an upload completed: answer the request that
+// waited for it in state 5
+void finish_upload(Worker &worker, ChunkedClientInfo &client)
+{
+    client.io_pending = false;
+    client.upload_state = 2;
+    respond(client.fd, client);
+    if (client.upload_state == 5 && !client.io_pending)
+        dispatch_response(worker, client);
+    serve_pipelined(worker, client, false);
+}
+
+static void on_listener_event(Worker &worker, EventHandle *handle, uint32_t events)
+{
+    ServerInfo *server = static_cast<ServerInfo *>(handle);
+    if (!(events & EPOLLIN))
+        return;
+    // Handle new connection for this specific server
+    if (handle_new_connections(worker, *server) && worker.global->edge_triggered)
+    {
+        // Batch used up: re-arm so the edge fires again for the rest
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLET;
+        ev.data.ptr = static_cast<EventHandle *>(server);
+        epoll_ctl(worker.epfd, EPOLL_CTL_MOD, server->socket_fd, &ev);
+    }
+}
+
+void on_client_event(Worker &worker, EventHandle *handle, uint32_t events)
+{
+    ChunkedClientInfo *client = static_cast<ChunkedClientInfo *>(handle);
+    if (client->task)
+    {
+        // The coroutine handles what it waits for; a socket that fails
+        // while it waits for something else is closed under it
+        if (!wake_connection_task(*client, TASK_SOCKET, events) && (events & EPOLLERR))
+            worker.closing.push_back(ClientRef(client->fd, client->generation));
+        return;
+    }
+    if (events & EPOLLERR)
+        fail_client(*client);
+    if (!(events & EPOLLIN) || !client->is_active)
+    {
+        flush_client(worker, *client, false);
+        return;
+    }
+
+    int fd = client->fd;
+    size_t client_server_idx = client->server_index;
+    // Validate server index
+    if (client_server_idx < client->config->global_obj.size())
+    {
+        service_client(worker, fd, *client, client_server_idx);
+    }
+    else
+    {
+        // Clean up invalid client
+        client->is_active = false;
+        worker.closing.push_back(ClientRef(fd, client->generation));
+    }
+}
+
+// CGI output is ready: collect it, and once the script is done answer
+// the client that is waiting on it
+void on_cgi_pipe_event(Worker &worker, EventHandle *handle, uint32_t events)
+{
+    ChunkedClientInfo *client = static_cast<CgiPipeHandle *>(handle)->client;
+    // The coroutine collects the output itself
+    if (client->task)
+    {
+        wake_connection_task(*client, TASK_CGI, events);
+        return;
+    }
+    if (!read_cgi_output(*client))
+        return;
+    finish_cgi_request(*client, client->fd);
+    flush_client(worker, *client, false);
+}
+
+// The script's stdin has room: feed it more of the body, and close it
+// once the body is in
+void on_cgi_stdin_event(Worker &worker, EventHandle *handle, uint32_t events)
+{
+    (void)worker;
+    (void)events;
+    ChunkedClientInfo *client = static_cast<CgiStdinHandle *>(handle)->client;
+    if (write_cgi_input(*client))
+        stop_cgi_input(*client);
+}
+
+// Give the clients queued by schedule_client() their turn. Clients queued
+// again meanwhile wait for the next round, after the next batch of events.
+void run_queued_clients(Worker &worker)
+{
+    std::vector<ClientRef> runnable;
+    runnable.swap(worker.runnable);
+    for (size_t i = 0; i < runnable.size(); ++i)
+    {
+        ChunkedClientInfo *client = worker.clients.find(runnable[i]);
+        if (!client)
+            continue;
+        client->scheduled = false;
+        if (client->task)
+        {
+            wake_connection_task(*client, TASK_TURN, 0);
+            continue;
+        }
+        bool reading = client->upload_state == 0 || client->upload_state == 1;
+        if (client->is_active && reading && client->server_index < client->config->global_obj.size())
+            service_client(worker, client->fd, *client, client->server_index);
+        else
+            flush_client(worker, *client, false);
+    }
+}
+
+// Close the clients that finished or failed during this batch, then the
+// ones whose deadline passed. Only due timers are visited.
+void close_finished_clients(Worker &worker)
+{
+    std::vector<int> expired;
+    worker.timers.advance(worker.now, expired);
+    for (size_t i = 0; i < expired.size(); ++i)
+    {
+        ChunkedClientInfo *client = worker.clients.find(expired[i]);
+        if (!client)
+        {
+            // Accepted, but not a byte within the header timeout
+            PendingClient *pending = worker.clients.find_pending(expired[i]);
+            if (pending)
+            {
+                std::cout << "Client " << expired[i] << " timed out" << std::endl;
+                worker.closing.push_back(ClientRef(expired[i], pending->generation));
+            }
+            continue;
+        }
+        // A coroutine deals with its own deadline
+        if (expire_connection_task(*client))
+            continue;
+        if (client->is_active && client->upload_state == 3 && client->cgi_pipe.pid > 0)
+        {
+            // The script is stopped, the client still gets its 504
+            cgi_timed_out(*client, client->fd);
+            flush_client(worker, *client, false);
+            continue;
+        }
+        std::cout << "Client " << expired[i] << " timed out" << std::endl;
+        worker.closing.push_back(ClientRef(expired[i], client->generation));
+    }
+
+    for (size_t i = 0; i < worker.closing.size(); ++i)
+        close_client(worker, worker.closing[i]);
+    worker.closing.clear();
+}
+
+// Another thread published a configuration; check_worker() picks it up
+// once the current batch is done
+static void on_wakeup(Worker &worker, EventHandle *handle, uint32_t events)
+{
+    (void)worker;
+    (void)events;
+    uint64_t count;
+    if (read(handle->fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+        perror("wakeup eventfd read failed");
+}
+
+// eventfd through which a reload on another thread reaches this worker
+static void setup_wakeup(Worker &worker)
+{
+    worker.wakeup.fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (worker.wakeup.fd == -1)
+    {
+        perror("eventfd failed");
+        return;
+    }
+    worker.wakeup.on_event = on_wakeup;
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = &worker.wakeup;
+    if (epoll_ctl(worker.epfd, EPOLL_CTL_ADD, worker.wakeup.fd, &ev) == -1)
+    {
+        perror("epoll_ctl: wakeup eventfd");
+        close(worker.wakeup.fd);
+        worker.wakeup.fd = -1;
+        return;
+    }
+    watch_config(worker.wakeup.fd);
+}
+
+// Move the worker to the configuration published last. New connections
+// start on it and connections move over between requests; listeners
+// follow its addresses, and those that stay are not touched.
+static void adopt_config(Worker &worker)
+{
+    ConfigSnapshot *config = acquire_config();
+    if (config == worker.config)
+    {
+        release_config(config);
+        return;
+    }
+
+    const ServerInfo *before = worker.servers.empty() ? NULL : &worker.servers[0];
+    size_t count = worker.servers.size();
+    std::vector<size_t> stopped = sync_listeners(worker.servers, *config);
+    for (size_t i = 0; i < stopped.size(); ++i)
+        stop_listener(worker, stopped[i]);
+    // New listeners may have moved the old ones epoll points at
+    bool moved = !worker.servers.empty() && &worker.servers[0] != before;
+    for (size_t i = 0; i < worker.servers.size(); ++i)
+    {
+        // Paused listeners are all registered again when shedding ends
+        if (worker.servers[i].socket_fd == -1 || worker.overload.shedding)
+            continue;
+        if (i >= count)
+            watch_listener(worker, i, EPOLL_CTL_ADD);
+        else if (moved && !worker.ring)
+            watch_listener(worker, i, EPOLL_CTL_MOD);
+    }
+
+    release_config(worker.config);
+    worker.config = config;
+    std::cout << "Worker " << worker.id << " on configuration " << config->generation << ", "
+              << stopped.size() << " listeners closed, " << worker.servers.size() - count << " opened" << std::endl;
+}
+
+// Pre-fork reload: workers started with the new configuration take over
+// the listeners, and this one finishes the requests it has and exits
+static void start_draining(Worker &worker)
+{
+    worker.draining = true;
+    for (size_t i = 0; i < worker.servers.size(); ++i)
+    {
+        if (worker.servers[i].socket_fd != -1)
+            stop_listener(worker, i);
+    }
+    for (size_t fd = 0; fd < worker.clients.capacity(); ++fd)
+    {
+        // Connections that never sent anything go like idle ones
+        PendingClient *pending = worker.clients.find_pending(fd);
+        if (pending)
+            worker.closing.push_back(ClientRef(fd, pending->generation));
+        ChunkedClientInfo *client = worker.clients.find(fd);
+        if (!client)
+            continue;
+        // Responses still to come close their connection
+        client->max_requests = 0;
+        client->keep_alive = false;
+        if (client->upload_state == 0 && client->requests > 0 && client->partial_data.empty())
+            worker.closing.push_back(ClientRef(fd, client->generation));
+    }
+    close_finished_clients(worker);
+    std::cout << "Worker " << worker.id << " draining " << worker.clients.size() << " connections" << std::endl;
+}
+
+// Between batches: run a reload SIGHUP asked for, follow a configuration
+// published by another thread, and drain on SIGQUIT. Returns false once a
+// draining worker has no connection left.
+bool check_worker(Worker &worker)
+{
+    if (take_reload_request())
+        reload_config();
+    if (worker.config->generation != current_config_generation() && !worker.draining)
+        adopt_config(worker);
+    if (drain_requested && !worker.draining)
+        start_draining(worker);
+    return !worker.draining || worker.clients.size() > 0;
+}
+
+// Main server loop for one worker
+void run_event_loop(Worker &worker)
+{
+    int epfd = worker.epfd;
+
+    current_worker = &worker;
+    setup_wakeup(worker);
+    // The I/O threads start before the worker pins itself, so they do not
+    // inherit its single CPU
+    if (worker.global->io_threads > 0 && start_io_pool(worker.global->io_threads))
+    {
+        if (setup_io_completions(worker))
+            worker.io_done.on_event = on_io_done;
+    }
+    place_worker(worker);
+    setup_overload(worker);
+    if (worker.global->io_uring && run_uring_event_loop(worker))
+        return;
+    while (true)
+    {
+        struct epoll_event events[MAX_EVENTS];
+        worker.now = time(NULL);
+        int timeout = worker.runnable.empty() ? worker.timers.next_timeout(worker.now) : 0;
+        int nfds = epoll_wait(epfd, events, MAX_EVENTS, overload_timeout(worker, timeout));
+        struct timespec woke;
+        clock_gettime(CLOCK_MONOTONIC, &woke);
+        worker.now = time(NULL);
+        size_t queued = worker.runnable.size();
+
+        if (nfds < 0)
+        {
+            // A signal (SIGHUP, SIGQUIT) still gets to check_worker()
+            if (errno != EINTR)
+                perror("epoll_wait failed");
+            nfds = 0;
+        }
+
+        for (int i = 0; i < nfds; i++)
+        {
+            EventHandle *handle = static_cast<EventHandle *>(events[i].data.ptr);
+            handle->on_event(worker, handle, events[i].events);
+        }
+
+        run_queued_clients(worker);
+        close_finished_clients(worker);
+        update_overload(worker, woke, queued);
+        if (!check_worker(worker))
+            break;
+    }
+}
+
+// CPU from worker_cpu_affinity for worker i, -1 when workers are not
+// pinned. A list shorter than the worker count is reused from the start.
+static int worker_cpu(const GlobalConfig &global, size_t i)
+{
+    if (global.worker_cpus.empty())
+        return -1;
+    if (i == global.worker_cpus.size())
+        std::cerr << "Warning: more workers than CPUs in worker_cpu_affinity, some CPUs run two workers"
+                  << std::endl;
+    return global.worker_cpus[i % global.worker_cpus.size()];
+}
+
+static void *worker_thread(void *arg)
+{
+    Worker *worker = static_cast<Worker *>(arg);
+    run_event_loop(*worker);
+    return NULL;
+}
+
+static volatile sig_atomic_t g_master_stop = 0;
+
+static void master_signal_handler(int sig)
+{
+    (void)sig;
+    g_master_stop = 1;
+}
+
+static void drain_signal_handler(int sig)
+{
+    (void)sig;
+    drain_requested = 1;
+}
+
+// Fork one worker that runs the event loop on the inherited listeners
+static pid_t spawn_worker_process(Worker &worker)
+{
+    pid_t pid = fork();
+    if (pid != 0)
+        return pid;
+
+    signal(SIGTERM, SIG_DFL);
+    signal(SIGINT, SIG_DFL);
+    // The master reloads; it retires this worker with SIGQUIT
+    signal(SIGHUP, SIG_IGN);
+    struct sigaction sa;
+    std::memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = drain_signal_handler;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGQUIT, &sa, NULL);
+    if (!register_listeners(worker))
+        _exit(1);
+    run_event_loop(worker);
+    close_worker(worker);
+    _exit(0);
+}
+
+// Pre-fork reload: bring the master's listeners in line with the new
+// configuration, start a new generation of workers on it, and tell the
+// old ones to finish their connections and exit. Their exit is not a
+// crash: they move from pids to retired, so they are reaped but not
+// restarted.
+static void rotate_worker_processes(std::vector<Worker> &workers, std::vector<pid_t> &pids,
+                                    std::vector<pid_t> &retired, std::vector<time_t> &started_at,
+                                    std::vector<ServerInfo> &servers)
+{
+    ConfigSnapshot *config = acquire_config();
+    std::vector<size_t> stopped = sync_listeners(servers, *config);
+    for (size_t i = 0; i < stopped.size(); ++i)
+    {
+        close(servers[stopped[i]].socket_fd);
+        servers[stopped[i]].socket_fd = -1;
+        servers[stopped[i]].fd = -1;
+    }
+
+    for (size_t i = 0; i < workers.size(); ++i)
+    {
+        if (pids[i] > 0)
+        {
+            kill(pids[i], SIGQUIT);
+            retired.push_back(pids[i]);
+        }
+        release_config(workers[i].config);
+        retain_config(config);
+        workers[i].config = config;
+        workers[i].servers = servers;
+        pids[i] = spawn_worker_process(workers[i]);
+        started_at[i] = time(NULL);
+        if (pids[i] < 0)
+            perror("fork worker failed");
+    }
+    release_config(config);
+    std::cout << "Master started " << workers.size() << " workers on the new configuration" << std::endl;
+}
+
+// Pre-fork mode: the master binds every listener once, forks
+// global.worker_processes workers that inherit them, and restarts any
+// worker that dies. A crash (CGI hang, bad upload) only costs one worker.
+static int run_worker_processes(const GlobalConfig &global)
+{
+    std::vector<ServerInfo> servers;
+    std::map<int, size_t> socket_fd_to_default_index;
+    ConfigSnapshot *config = acquire_config();
+
+    servers.reserve(config->global_obj.size());
+    setup_all_sockets(servers, config->global_obj, config->hostport_to_indexes, socket_fd_to_default_index);
+    release_config(config);
+    install_reload_handler();
+
+    struct sigaction sa;
+    std::memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = master_signal_handler;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGINT, &sa, NULL);
+
+    std::vector<pid_t> pids(global.worker_processes, -1);
+    std::vector<pid_t> retired; // Workers of older generations still draining
+    std::vector<time_t> started_at(global.worker_processes, 0);
+    std::vector<Worker> workers(global.worker_processes);
+
+    for (size_t i = 0; i < workers.size(); ++i)
+    {
+        workers[i].id = i;
+        workers[i].cpu = worker_cpu(global, i);
+        workers[i].config = acquire_config();
+        workers[i].global = &global;
+        workers[i].servers = servers;
+        pids[i] = spawn_worker_process(workers[i]);
+        started_at[i] = time(NULL);
+        if (pids[i] < 0)
+            perror("fork worker failed");
+    }
+    std::cout << "Master " << getpid() << " started " << workers.size() << " worker processes" << std::endl;
+
+    while (!g_master_stop)
+    {
+        if (take_reload_request() && reload_config())
+            rotate_worker_processes(workers, pids, retired, started_at, servers);
+
+        int status;
+        pid_t pid = waitpid(-1, &status, 0);
+        if (pid < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno != ECHILD)
+                perror("waitpid failed");
+            sleep(1);
+        }
+
+        std::vector<pid_t>::iterator old = std::find(retired.begin(), retired.end(), pid);
+        if (pid > 0 && old != retired.end())
+        {
+            retired.erase(old);
+            std::cout << "Retired worker (pid " << pid << ") finished draining" << std::endl;
+            continue;
+        }
+
+        for (size_t i = 0; i < pids.size(); ++i)
+        {
+            if (pids[i] > 0 && pids[i] != pid)
+                continue;
+            if (pids[i] > 0)
+            {
+                if (WIFSIGNALED(status))
+                    std::cerr << "Worker " << i << " (pid " << pid << ") killed by signal " << WTERMSIG(status) << std::endl;
+                else
+                    std::cerr << "Worker " << i << " (pid " << pid << ") exited with status " << WEXITSTATUS(status) << std::endl;
+            }
+            if (g_master_stop)
+                break;
+
+            // Do not spin if a worker dies right after it starts
+            if (time(NULL) - started_at[i] < 1)
+                sleep(1);
+            pids[i] = spawn_worker_process(workers[i]);
+            started_at[i] = time(NULL);
+            if (pids[i] < 0)
+                perror("fork worker failed");
+            else
+                std::cout << "Restarted worker " << i << " (pid " << pids[i] << ")" << std::endl;
+        }
+    }
+
+    // Workers still draining an older configuration go too, or they would
+    // keep serving on the inherited listeners after the master is gone
+    std::cout << "Master shutting down" << std::endl;
+    for (size_t i = 0; i < pids.size(); ++i)
+    {
+        if (pids[i] > 0)
+            retired.push_back(pids[i]);
+    }
+    for (size_t i = 0; i < retired.size(); ++i)
+        kill(retired[i], SIGTERM);
+    for (size_t i = 0; i < retired.size(); ++i)
+    {
+        while (waitpid(retired[i], NULL, 0) < 0 && errno == EINTR)
+            ;
+    }
+    for (size_t i = 0; i < servers.size(); ++i)
+    {
+        if (servers[i].socket_fd != -1)
+            close(servers[i].socket_fd);
+    }
+    for (size_t i = 0; i < workers.size(); ++i)
+        release_config(workers[i].config);
+    return 0;
+}
+
+// Start global.worker_processes pre-forked workers, or global.worker_threads
+// event loops. With a single worker the loop runs on the main thread, exactly
+// as before.
+int run_workers(const GlobalConfig &global)
+{
+    if (global.worker_processes > 1)
+    {
+        if (global.worker_threads > 1)
+            std::cerr << "Warning: worker_threads is ignored when worker_processes is set" << std::endl;
+        return run_worker_processes(global);
+    }
+
+    std::vector<Worker> workers(global.worker_threads);
+    install_reload_handler();
+
+    for (size_t i = 0; i < workers.size(); ++i)
+    {
+        workers[i].id = i;
+        workers[i].cpu = worker_cpu(global, i);
+        workers[i].config = acquire_config();
+        workers[i].global = &global;
+        if (!setup_worker(workers[i]))
+        {
+            for (size_t j = 0; j < i; ++j)
+                close_worker(workers[j]);
+            return 1;
+        }
+    }
+
+    if (workers.size() == 1)
+    {
+        run_event_loop(workers[0]);
+        close_worker(workers[0]);
+        return 0;
+    }
+
+    size_t started = 0;
+    for (; started < workers.size(); ++started)
+    {
+        int err = pthread_create(&workers[started].thread, NULL, worker_thread, &workers[started]);
+        if (err != 0)
+        {
+            std::cerr << "Failed to start worker " << started << ": " << strerror(err) << std::endl;
+            break;
+        }
+    }
+    std::cout << "Started " << started << " worker threads" << std::endl;
+
+    // SIGHUP has to interrupt the wait of a worker, which then reloads and
+    // wakes the others; this thread only joins
+    sigset_t reload;
+    sigemptyset(&reload);
+    sigaddset(&reload, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &reload, NULL);
+
+    // Listeners of workers that never started would still receive their share
+    // of SO_REUSEPORT connections, so close them right away
+    for (size_t i = started; i < workers.size(); ++i)
+        close_worker(workers[i]);
+
+    for (size_t i = 0; i < started; ++i)
+        pthread_join(workers[i].thread, NULL);
+    for (size_t i = 0; i < started; ++i)
+        close_worker(workers[i]);
+    return started == workers.size() ? 0 : 1;
+}